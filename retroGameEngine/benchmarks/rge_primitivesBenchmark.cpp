@@ -0,0 +1,342 @@
+//////////////////////////////////////////////////////////////////////////////////////////
+
+/* Primitive throughput benchmark for the RetroGameEngine core draw API
+
+	Measures calls/s and Mpixels/s for every core primitive, under every
+	jpr::Pixel::Mode and across several draw target sizes. The engine is
+	constructed but never started, so no window or OpenGL context is needed.
+
+	Build (Linux):
+		g++ -std=c++14 -O2 -o rge_primitivesBenchmark rge_primitivesBenchmark.cpp -lX11 -lGL -lpng -lpthread
+
+	Usage:
+		./rge_primitivesBenchmark [min_ms_per_case] [filter]
+
+	The report is CSV on stdout, one row per (primitive, mode, target) in a
+	fixed order, so two runs can be diffed directly:
+
+		primitive,mode,target_w,target_h,calls,pixels_per_call,ns_per_call,calls_per_s,mpixels_per_s
+
+	"pixels_per_call" is the nominal number of pixels the primitive covers,
+	all geometry is kept inside the target so no pixels are lost to clipping.
+	Each case is calibrated to run for at least min_ms_per_case (default 20),
+	and the best of three repeats is reported.
+*/
+
+#define JPR_PGE_APPLICATION
+#include "../retroGameEngine.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+class PrimitivesBenchmark : public jpr::RetroGameEngine
+{
+public:
+	PrimitivesBenchmark()
+	{
+		sAppName = "Primitives Benchmark";
+	}
+
+public:
+	struct Case
+	{
+		const char *sName;
+		// Pixels covered by a single call for a given target size
+		std::function<double(int32_t w, int32_t h)> funcPixels;
+		// Issues one call, i is the call index used to vary the geometry
+		std::function<void(int32_t w, int32_t h, uint32_t i)> funcDraw;
+	};
+
+	void Run(double fMinSeconds, const std::string &sFilter)
+	{
+		const int32_t vTargets[][2] = { { 256, 240 }, { 640, 480 }, { 1920, 1080 } };
+		const jpr::Pixel::Mode vModes[] = { jpr::Pixel::NORMAL, jpr::Pixel::MASK, jpr::Pixel::ALPHA, jpr::Pixel::CUSTOM };
+		const char *vModeNames[] = { "NORMAL", "MASK", "ALPHA", "CUSTOM" };
+
+		BuildSprite();
+		BuildCases();
+
+		printf("primitive,mode,target_w,target_h,calls,pixels_per_call,ns_per_call,calls_per_s,mpixels_per_s\n");
+
+		for (auto &c : vCases)
+		{
+			if (!sFilter.empty() && std::string(c.sName).find(sFilter) == std::string::npos)
+				continue;
+
+			for (int m = 0; m < 4; m++)
+			{
+				for (auto &t : vTargets)
+				{
+					jpr::Sprite target(t[0], t[1]);
+					SetDrawTarget(&target);
+					SetModeForCase(vModes[m]);
+
+					uint64_t nCalls = 0;
+					double fSeconds = Measure(c, t[0], t[1], fMinSeconds, nCalls);
+					double fPixels = c.funcPixels(t[0], t[1]);
+
+					printf("%s,%s,%d,%d,%llu,%.0f,%.2f,%.0f,%.3f\n",
+						c.sName, vModeNames[m], t[0], t[1], (unsigned long long)nCalls, fPixels,
+						fSeconds * 1e9 / (double)nCalls,
+						(double)nCalls / fSeconds,
+						(double)nCalls * fPixels / fSeconds / 1e6);
+					fflush(stdout);
+
+					SetPixelMode(jpr::Pixel::NORMAL);
+					SetDrawTarget(nullptr);
+				}
+			}
+		}
+	}
+
+private:
+	std::vector<Case> vCases;
+	jpr::Sprite sprTile;
+	// Text drawn by the string cases, and the pixels it covers at scale 1
+	const std::string sScoreText = "Score: 01234567";
+	double fScoreTextPixels = 0.0;
+	jpr::Pixel pDrawColour;
+	std::vector<jpr::vi2d> vGraph;
+	std::vector<uint32_t> vMesh;
+	static const uint32_t nMeshOffsets = 16;
+	std::vector<jpr::vi2d> vMeshVertices[nMeshOffsets];
+	int32_t nMeshW = 0, nMeshH = 0;
+	std::vector<jpr::Pixel> vMeshColour;
+
+	// Deterministic geometry, the same sequence of positions every run
+	static uint32_t Rnd(uint32_t i, uint32_t nRange)
+	{
+		uint32_t x = i * 2654435761u + 0x9E3779B9u;
+		x ^= x >> 15; x *= 0x85EBCA6Bu; x ^= x >> 13;
+		return nRange ? x % nRange : 0;
+	}
+
+	void SetModeForCase(jpr::Pixel::Mode m)
+	{
+		// ALPHA uses a translucent colour so the blend is not trivially opaque
+		pDrawColour = (m == jpr::Pixel::ALPHA) ? jpr::Pixel(255, 128, 64, 128) : jpr::Pixel(255, 128, 64);
+		vMeshColour.assign(1, pDrawColour);
+
+		if (m == jpr::Pixel::CUSTOM)
+			SetPixelMode([](const int x, const int y, const jpr::Pixel &s, const jpr::Pixel &d)
+			{
+				UNUSED(x); UNUSED(y);
+				return jpr::Pixel((s.r + d.r) / 2, (s.g + d.g) / 2, (s.b + d.b) / 2);
+			});
+		else
+			SetPixelMode(m);
+	}
+
+	void BuildSprite()
+	{
+		// 32x32 checkerboard of opaque and fully transparent 4x4 cells
+		sprTile = jpr::Sprite(32, 32);
+		for (int32_t y = 0; y < 32; y++)
+			for (int32_t x = 0; x < 32; x++)
+				sprTile.SetPixel(x, y, ((x / 4 + y / 4) & 1) ? jpr::Pixel(x * 8, y * 8, 128, 255) : jpr::BLANK);
+	}
+
+	void BuildCases()
+	{
+		const float fPi = 3.14159265f;
+		jpr::vi2d vTextSize = GetTextSize(sScoreText);
+		fScoreTextPixels = (double)vTextSize.x * vTextSize.y;
+
+		vCases.push_back({ "Clear",
+			[](int32_t w, int32_t h) { return (double)w * h; },
+			[this](int32_t w, int32_t h, uint32_t i) { UNUSED(w); UNUSED(h); UNUSED(i); Clear(pDrawColour); } });
+
+		vCases.push_back({ "Draw",
+			[](int32_t w, int32_t h) { UNUSED(w); UNUSED(h); return 1.0; },
+			[this](int32_t w, int32_t h, uint32_t i) { Draw(Rnd(i, w), Rnd(i + 1, h), pDrawColour); } });
+
+		vCases.push_back({ "DrawLine",
+			[](int32_t w, int32_t h) { UNUSED(h); return (double)(w / 2 + 1); },
+			[this](int32_t w, int32_t h, uint32_t i)
+			{
+				int32_t x = Rnd(i, w / 2), y = Rnd(i + 1, h / 2);
+				DrawLine(x, y, x + w / 2, y + h / 2, pDrawColour);
+			} });
+
+		vCases.push_back({ "DrawLinePattern",
+			[](int32_t w, int32_t h) { UNUSED(h); return (double)(w / 2 + 1) / 2.0; },
+			[this](int32_t w, int32_t h, uint32_t i)
+			{
+				int32_t x = Rnd(i, w / 2), y = Rnd(i + 1, h / 2);
+				DrawLine(x, y, x + w / 2, y + h / 2, pDrawColour, 0xF0F0F0F0);
+			} });
+
+		vCases.push_back({ "DrawPolyline64",
+			[](int32_t w, int32_t h) { UNUSED(h); return (double)w; },
+			[this](int32_t w, int32_t h, uint32_t i)
+			{
+				// A shallow graph trace across the target, 64 segments
+				vGraph.resize(65);
+				for (int32_t k = 0; k <= 64; k++)
+				{
+					vGraph[k].x = k * (w - 1) / 64;
+					vGraph[k].y = h / 2 + Rnd(i + k, 8);
+				}
+				DrawPolyline(vGraph, pDrawColour);
+			} });
+
+		vCases.push_back({ "DrawRect",
+			[](int32_t w, int32_t h) { return 2.0 * (w / 4) + 2.0 * (h / 4); },
+			[this](int32_t w, int32_t h, uint32_t i) { DrawRect(Rnd(i, w / 2), Rnd(i + 1, h / 2), w / 4, h / 4, pDrawColour); } });
+
+		vCases.push_back({ "FillRect",
+			[](int32_t w, int32_t h) { return (double)(w / 4) * (h / 4); },
+			[this](int32_t w, int32_t h, uint32_t i) { FillRect(Rnd(i, w / 2), Rnd(i + 1, h / 2), w / 4, h / 4, pDrawColour); } });
+
+		vCases.push_back({ "DrawCircle",
+			[fPi](int32_t w, int32_t h) { return 2.0 * fPi * (std::min(w, h) / 8); },
+			[this](int32_t w, int32_t h, uint32_t i)
+			{
+				int32_t r = std::min(w, h) / 8;
+				DrawCircle(r + Rnd(i, w - 2 * r), r + Rnd(i + 1, h - 2 * r), r, pDrawColour);
+			} });
+
+		vCases.push_back({ "FillCircle",
+			[fPi](int32_t w, int32_t h) { double r = std::min(w, h) / 8; return fPi * r * r; },
+			[this](int32_t w, int32_t h, uint32_t i)
+			{
+				int32_t r = std::min(w, h) / 8;
+				FillCircle(r + Rnd(i, w - 2 * r), r + Rnd(i + 1, h - 2 * r), r, pDrawColour);
+			} });
+
+		vCases.push_back({ "DrawTriangle",
+			[](int32_t w, int32_t h) { UNUSED(h); return 3.0 * (w / 4); },
+			[this](int32_t w, int32_t h, uint32_t i)
+			{
+				int32_t x = Rnd(i, w / 2), y = Rnd(i + 1, h / 2);
+				DrawTriangle(x, y, x + w / 4, y, x, y + h / 4, pDrawColour);
+			} });
+
+		vCases.push_back({ "FillTriangle",
+			[](int32_t w, int32_t h) { return (double)(w / 4) * (h / 4) / 2.0; },
+			[this](int32_t w, int32_t h, uint32_t i)
+			{
+				int32_t x = Rnd(i, w / 2), y = Rnd(i + 1, h / 2);
+				FillTriangle(x, y, x + w / 4, y, x, y + h / 4, pDrawColour);
+			} });
+
+		vCases.push_back({ "FillTrianglesMesh",
+			[](int32_t w, int32_t h) { return (double)(w / 2) * (h / 2); },
+			[this](int32_t w, int32_t h, uint32_t i)
+			{
+				// 16x16 quads over half the target, two triangles each, drawn in one call.
+				// The mesh is built once per target at a few offsets, so the timed
+				// calls only pick one of them
+				const int32_t N = 16;
+				if (vMesh.empty())
+				{
+					for (int32_t j = 0; j < N; j++)
+						for (int32_t k = 0; k < N; k++)
+						{
+							uint32_t q = j * (N + 1) + k;
+							vMesh.insert(vMesh.end(), { q, q + 1, q + N + 2, q, q + N + 2, q + N + 1 });
+						}
+				}
+				if (w != nMeshW || h != nMeshH)
+				{
+					nMeshW = w; nMeshH = h;
+					for (uint32_t m = 0; m < nMeshOffsets; m++)
+					{
+						std::vector<jpr::vi2d> &v = vMeshVertices[m];
+						v.resize((N + 1) * (N + 1));
+						int32_t ox = Rnd(m * 2, w / 2), oy = Rnd(m * 2 + 1, h / 2);
+						for (int32_t j = 0; j <= N; j++)
+							for (int32_t k = 0; k <= N; k++)
+							{
+								v[j * (N + 1) + k].x = ox + k * (w / 2) / N;
+								v[j * (N + 1) + k].y = oy + j * (h / 2) / N;
+							}
+					}
+				}
+				FillTriangles(vMeshVertices[(i / 2) % nMeshOffsets], vMesh, vMeshColour);
+			} });
+
+		vCases.push_back({ "DrawSprite",
+			[](int32_t w, int32_t h) { UNUSED(w); UNUSED(h); return 32.0 * 32.0; },
+			[this](int32_t w, int32_t h, uint32_t i) { DrawSprite(Rnd(i, w - 32), Rnd(i + 1, h - 32), &sprTile); } });
+
+		vCases.push_back({ "DrawSpriteScale2",
+			[](int32_t w, int32_t h) { UNUSED(w); UNUSED(h); return 64.0 * 64.0; },
+			[this](int32_t w, int32_t h, uint32_t i) { DrawSprite(Rnd(i, w - 64), Rnd(i + 1, h - 64), &sprTile, 2); } });
+
+		vCases.push_back({ "DrawSpriteFlipHV",
+			[](int32_t w, int32_t h) { UNUSED(w); UNUSED(h); return 32.0 * 32.0; },
+			[this](int32_t w, int32_t h, uint32_t i) { DrawSprite(Rnd(i, w - 32), Rnd(i + 1, h - 32), &sprTile, 1, jpr::Sprite::HORIZ | jpr::Sprite::VERT); } });
+
+		vCases.push_back({ "DrawPartialSprite",
+			[](int32_t w, int32_t h) { UNUSED(w); UNUSED(h); return 16.0 * 16.0; },
+			[this](int32_t w, int32_t h, uint32_t i) { DrawPartialSprite(Rnd(i, w - 16), Rnd(i + 1, h - 16), &sprTile, 8, 8, 16, 16); } });
+
+		vCases.push_back({ "DrawPartialSpriteScale4",
+			[](int32_t w, int32_t h) { UNUSED(w); UNUSED(h); return 64.0 * 64.0; },
+			[this](int32_t w, int32_t h, uint32_t i) { DrawPartialSprite(Rnd(i, w - 64), Rnd(i + 1, h - 64), &sprTile, 8, 8, 16, 16, 4); } });
+
+		vCases.push_back({ "DrawSpriteView",
+			[](int32_t w, int32_t h) { UNUSED(w); UNUSED(h); return 16.0 * 16.0; },
+			[this](int32_t w, int32_t h, uint32_t i) { DrawSprite(Rnd(i, w - 16), Rnd(i + 1, h - 16), sprTile.GetView(8, 8, 16, 16)); } });
+
+		vCases.push_back({ "DrawString",
+			[this](int32_t w, int32_t h) { UNUSED(w); UNUSED(h); return fScoreTextPixels; },
+			[this](int32_t w, int32_t h, uint32_t i) { DrawString(Rnd(i, w - 128), Rnd(i + 1, h - 8), sScoreText, pDrawColour); } });
+
+		vCases.push_back({ "DrawStringCached",
+			[this](int32_t w, int32_t h) { UNUSED(w); UNUSED(h); return fScoreTextPixels; },
+			[this](int32_t w, int32_t h, uint32_t i) { DrawStringCached(Rnd(i, w - 128), Rnd(i + 1, h - 8), sScoreText, pDrawColour); } });
+
+		vCases.push_back({ "DrawStringScale2",
+			[this](int32_t w, int32_t h) { UNUSED(w); UNUSED(h); return fScoreTextPixels * 4.0; },
+			[this](int32_t w, int32_t h, uint32_t i) { DrawString(Rnd(i, w - 256), Rnd(i + 1, h - 16), sScoreText, pDrawColour, 2); } });
+	}
+
+	double Measure(Case &c, int32_t w, int32_t h, double fMinSeconds, uint64_t &nCallsOut)
+	{
+		// Calibrate the number of calls so a single repeat lasts fMinSeconds
+		uint64_t nCalls = 1;
+		double fBest = 0.0;
+		while (true)
+		{
+			double t = TimeCalls(c, w, h, nCalls);
+			if (t >= fMinSeconds || nCalls >= (1ull << 32))
+			{
+				fBest = t;
+				break;
+			}
+			nCalls *= (t > 0.0 && t < fMinSeconds / 8.0) ? 8 : 2;
+		}
+
+		// Best of three, scheduling noise only ever makes things slower
+		for (int r = 0; r < 2; r++)
+			fBest = std::min(fBest, TimeCalls(c, w, h, nCalls));
+
+		nCallsOut = nCalls;
+		return fBest;
+	}
+
+	double TimeCalls(Case &c, int32_t w, int32_t h, uint64_t nCalls)
+	{
+		auto tp1 = std::chrono::steady_clock::now();
+		for (uint64_t i = 0; i < nCalls; i++)
+			c.funcDraw(w, h, (uint32_t)i * 2);
+		auto tp2 = std::chrono::steady_clock::now();
+		return std::chrono::duration<double>(tp2 - tp1).count();
+	}
+};
+
+int main(int argc, char *argv[])
+{
+	double fMinSeconds = (argc > 1) ? atof(argv[1]) / 1000.0 : 0.02;
+	std::string sFilter = (argc > 2) ? argv[2] : "";
+
+	PrimitivesBenchmark bench;
+	if (!bench.Construct(256, 240, 1, 1))
+		return 1;
+
+	bench.Run(fMinSeconds, sFilter);
+	return 0;
+}
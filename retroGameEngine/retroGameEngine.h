@@ -83,6 +83,35 @@
 	static glSwapInterval_t *glSwapIntervalEXT;
 #endif
 
+// OpenGL buffer object entry points, loaded at runtime for the
+// pixel buffer object upload path (see SetAsyncUpload())
+#if defined(_WIN32)
+	#define JPR_GLAPI APIENTRY
+#else
+	#define JPR_GLAPI
+#endif
+#ifndef GL_PIXEL_UNPACK_BUFFER
+	#define GL_PIXEL_UNPACK_BUFFER	0x88EC
+#endif
+#ifndef GL_STREAM_DRAW
+	#define GL_STREAM_DRAW			0x88E0
+#endif
+#ifndef GL_WRITE_ONLY
+	#define GL_WRITE_ONLY			0x88B9
+#endif
+	typedef void(JPR_GLAPI glGenBuffers_t) (GLsizei n, GLuint *buffers);
+	typedef void(JPR_GLAPI glDeleteBuffers_t) (GLsizei n, const GLuint *buffers);
+	typedef void(JPR_GLAPI glBindBuffer_t) (GLenum target, GLuint buffer);
+	typedef void(JPR_GLAPI glBufferData_t) (GLenum target, ptrdiff_t size, const void *data, GLenum usage);
+	typedef void*(JPR_GLAPI glMapBuffer_t) (GLenum target, GLenum access);
+	typedef GLboolean(JPR_GLAPI glUnmapBuffer_t) (GLenum target);
+	static glGenBuffers_t *jpr_glGenBuffers;
+	static glDeleteBuffers_t *jpr_glDeleteBuffers;
+	static glBindBuffer_t *jpr_glBindBuffer;
+	static glBufferData_t *jpr_glBufferData;
+	static glMapBuffer_t *jpr_glMapBuffer;
+	static glUnmapBuffer_t *jpr_glUnmapBuffer;
+
 
 // Standard includes
 #include <cmath>
@@ -95,12 +124,27 @@
 #include <list>
 #include <thread>
 #include <atomic>
+#include <mutex>
 #include <condition_variable>
 #include <fstream>
+#include <sstream>
 #include <map>
 #include <functional>
 #include <algorithm>
 
+// SIMD kernels for the span blenders, chosen from what the compiler targets.
+// Define JPR_PGE_NO_SIMD to force the scalar paths
+#if !defined(JPR_PGE_NO_SIMD)
+	#if defined(__AVX2__)
+		#define JPR_PGE_AVX2
+		#include <immintrin.h>
+	#endif
+	#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+		#define JPR_PGE_SSE2
+		#include <emmintrin.h>
+	#endif
+#endif
+
 #undef min
 #undef max
 #define UNUSED(x) (void)(x)
@@ -210,6 +254,8 @@ namespace jpr
 
 	public:
 		jpr::rcode AddToPack(std::string sFile);
+		// Adds nSize bytes from memory as if they had been read from sFile
+		jpr::rcode AddToPack(std::string sFile, const uint8_t* pData, uint32_t nSize);
 
 	public:
 		jpr::rcode SavePack(std::string sFile);
@@ -224,46 +270,291 @@ namespace jpr
 		std::map<std::string, sEntry> mapFiles;
 	};
 
-	// A bitmap-like structure that stores a 2D array of Pixels
+	// Ring buffer of how long each phase of the last N frames took, in milliseconds
+	class FrameStats
+	{
+	public:
+		enum Phase { EVENTS, INPUT, UPDATE, UPLOAD, PRESENT, FRAME, PHASE_COUNT };
+
+		FrameStats(uint32_t nHistory = 600);
+		~FrameStats();
+
+	public:
+		// Number of frames held, at most the history size
+		uint32_t Count();
+		// Time taken by phase p nAgo frames back, 0 is the most recent frame
+		float Get(Phase p, uint32_t nAgo = 0);
+		// Time taken by phase p at the given percentile (0 to 100) of the held frames
+		float Percentile(Phase p, float fPercent);
+		float Average(Phase p);
+		float Max(Phase p);
+		// Streams every recorded frame to a CSV file as well
+		jpr::rcode OpenCSV(std::string sFile);
+		void CloseCSV();
+		static const char* PhaseName(Phase p);
+
+	public:
+		void Record(const float* fPhaseTimes);
+
+	private:
+		std::vector<float> vHistory;
+		uint32_t nHistory = 0;
+		uint32_t nCount = 0;
+		uint32_t nNext = 0;
+		uint64_t nFrame = 0;
+		std::ofstream ofsCSV;
+	};
+
+	struct SpriteView;
+
+	// Supplies the memory sprites keep their pixels in. Blocks are 64 byte
+	// aligned, and an allocator must outlive every sprite that uses it
+	class SpriteAllocator
+	{
+	public:
+		virtual ~SpriteAllocator() = default;
+		virtual void* Allocate(size_t nBytes) = 0;
+		virtual void Free(void* p, size_t nBytes) = 0;
+		// The general purpose heap, the default
+		static SpriteAllocator* Heap();
+	};
+
+	// Recycles blocks through free lists of power of two size classes, carved
+	// from large slabs, so loading and unloading similar sprites over and over
+	// stops reaching the heap. Blocks above nMaxBlock come from the heap
+	class SpritePoolAllocator : public SpriteAllocator
+	{
+	public:
+		SpritePoolAllocator(size_t nSlabBytes = 1024 * 1024, size_t nMaxBlock = 16 * 1024 * 1024);
+		~SpritePoolAllocator();
+		SpritePoolAllocator(const SpritePoolAllocator&) = delete;
+		SpritePoolAllocator& operator=(const SpritePoolAllocator&) = delete;
+
+	public:
+		void* Allocate(size_t nBytes) override;
+		void Free(void* p, size_t nBytes) override;
+
+	private:
+		static const int nMinClass = 10;
+		size_t nSlabBytes;
+		size_t nMaxBlock;
+		std::vector<std::vector<void*>> vFree;
+		std::vector<void*> vSlabs;
+		std::mutex mux;
+	};
+
+	// Hands out memory from the end of large chunks and never frees single
+	// blocks. Reset() takes everything back at once, for dropping a whole
+	// level's sprites together. Only Reset() once those sprites are gone
+	class SpriteArenaAllocator : public SpriteAllocator
+	{
+	public:
+		SpriteArenaAllocator(size_t nChunkBytes = 16 * 1024 * 1024);
+		~SpriteArenaAllocator();
+		SpriteArenaAllocator(const SpriteArenaAllocator&) = delete;
+		SpriteArenaAllocator& operator=(const SpriteArenaAllocator&) = delete;
+
+	public:
+		void* Allocate(size_t nBytes) override;
+		void Free(void* p, size_t nBytes) override;
+		// Rewinds to the start, the chunks are kept to be filled again
+		void Reset();
+		// Bytes handed out since the last Reset()
+		size_t Used();
+
+	private:
+		struct sChunk { uint8_t* pData; size_t nSize; };
+		size_t nChunkBytes;
+		std::vector<sChunk> vChunks;
+		size_t nChunk = 0;
+		size_t nOffset = 0;
+		size_t nUsed = 0;
+		std::mutex mux;
+	};
+
+	// A bitmap-like structure that stores a 2D array of Pixels. Rows are padded
+	// to a multiple of 8 pixels and start on a 32 byte boundary, so row y begins
+	// at GetData() + y * GetPitch()
 	class Sprite
 	{
 	public:
 		Sprite();
 		Sprite(std::string sImageFile);
 		Sprite(std::string sImageFile, jpr::ResourcePack *pack);
-		Sprite(int32_t w, int32_t h);
+		// The pixels come from pAllocator, or GetDefaultAllocator() if it is nullptr
+		Sprite(int32_t w, int32_t h, SpriteAllocator* pAllocator = nullptr);
 		~Sprite();
+		// Sprites own their pixels, so they can be moved but not copied
+		Sprite(Sprite&& other) noexcept;
+		Sprite& operator=(Sprite&& other) noexcept;
+		Sprite(const Sprite&) = delete;
+		Sprite& operator=(const Sprite&) = delete;
 
 	public:
 		jpr::rcode LoadFromFile(std::string sImageFile, jpr::ResourcePack *pack = nullptr);
+		// Loads each of vFiles into vSprites with LoadFromFile(), decoding on up to
+		// nThreads threads at once, 0 uses one per hardware thread. Sprites that
+		// fail to load are left empty, and FAIL is returned if any did
+		static jpr::rcode LoadBatch(const std::vector<std::string>& vFiles, std::vector<Sprite>& vSprites, jpr::ResourcePack *pack = nullptr, uint32_t nThreads = 0);
 		jpr::rcode LoadFromPGESprFile(std::string sImageFile, jpr::ResourcePack *pack = nullptr);
-		jpr::rcode SaveToPGESprFile(std::string sImageFile);
+		// Writes the sprite into pack under sImageFile instead, if one is given
+		jpr::rcode SaveToPGESprFile(std::string sImageFile, jpr::ResourcePack *pack = nullptr);
 
 	public:
 		int32_t width = 0;
 		int32_t height = 0;
 		enum Mode { NORMAL, PERIODIC };
+		enum Flip { NONE = 0, HORIZ = 1, VERT = 2 };
 
 	public:
 		void SetSampleMode(jpr::Sprite::Mode mode = jpr::Sprite::Mode::NORMAL);
+		Mode GetSampleMode();
 		Pixel GetPixel(int32_t x, int32_t y);
 		bool  SetPixel(int32_t x, int32_t y, Pixel p);
 
 		Pixel Sample(float x, float y);
 		Pixel SampleBL(float u, float v);
 		Pixel* GetData();
+		// Distance in pixels from the start of one row to the next
+		int32_t GetPitch();
+		// Non-owning views of the whole sprite, or of the area (x,y) to (x+w,y+h)
+		// clipped to it. They are valid until the sprite is destroyed or reloaded
+		SpriteView GetView();
+		SpriteView GetView(int32_t x, int32_t y, int32_t w, int32_t h);
+
+	public:
+		// Where sprites created or loaded from now on get their pixels, nullptr
+		// restores the heap. The engine's own sprites always use the heap
+		static void SetDefaultAllocator(SpriteAllocator* pAllocator);
+		static SpriteAllocator* GetDefaultAllocator();
 
 	private:
 		Pixel *pColData = nullptr;
+		// Where pColData came from, nullptr if the pixels belong to someone else
+		SpriteAllocator *pAllocator = nullptr;
+		size_t nAllocBytes = 0;
+		int32_t nPitch = 0;
 		Mode modeSample = Mode::NORMAL;
+		static SpriteAllocator* pDefaultAllocator;
+
+		void jpr_Create(int32_t w, int32_t h, SpriteAllocator* pFrom = nullptr);
+		void jpr_Wrap(const SpriteView& view);
+		void jpr_Destroy();
+		friend class RetroGameEngine;
 
 #ifdef JPR_DBG_OVERDRAW
 	public:
 		static int nOverdrawCount;
+		// How many times each pixel has been written by the draw routines since
+		// the last ResetOverdraw(), empty until this sprite is first drawn to
+		std::vector<uint16_t> vOverdraw;
+		uint16_t GetOverdraw(int32_t x, int32_t y);
+		void ResetOverdraw();
 #endif
 
 	};
 
+	// A rectangle of pixels owned by something else, such as a frame of a
+	// sprite sheet or an externally allocated buffer. Row y begins at
+	// pData + y * pitch. Views never own or free their pixels
+	struct SpriteView
+	{
+		SpriteView() = default;
+		// A pitch of 0 means the rows are packed, pitch == w
+		SpriteView(Pixel* pData, int32_t w, int32_t h, int32_t pitch = 0);
+
+		Pixel* pData = nullptr;
+		int32_t width = 0;
+		int32_t height = 0;
+		int32_t pitch = 0;
+
+		inline Pixel* At(int32_t x, int32_t y) const { return pData + y * pitch + x; }
+		// The area (x,y) to (x+w,y+h) of this view, clipped to it
+		SpriteView Sub(int32_t x, int32_t y, int32_t w, int32_t h) const;
+	};
+
+	// Packs many small images into a few large page sprites, so they share one
+	// allocation and sit together in memory. Add() copies an image and returns
+	// a handle, Build() packs everything added since the last Build(), and the
+	// handle then resolves to the page and area to draw with DrawPartialSprite()
+	class SpriteAtlas
+	{
+	public:
+		SpriteAtlas(int32_t nPageWidth = 1024, int32_t nPageHeight = 1024, int32_t nPadding = 1);
+		~SpriteAtlas();
+		SpriteAtlas(const SpriteAtlas&) = delete;
+		SpriteAtlas& operator=(const SpriteAtlas&) = delete;
+
+		static const uint32_t INVALID = 0xFFFFFFFF;
+		struct sRegion
+		{
+			int32_t nPage = -1;
+			int32_t x = 0, y = 0, w = 0, h = 0;
+		};
+
+	public:
+		// Copies an image in under a unique name. Adding a name again returns the
+		// handle it already has and leaves the image as it was
+		uint32_t Add(const std::string& sName, Sprite* sprite);
+		uint32_t Add(const std::string& sName, const SpriteView& image);
+		// Packs the images added since the last Build(), tallest first, each at the
+		// lowest point of a page's skyline it fits. Images bigger than a page get
+		// a page of their own. Pages grow as needed, so page pointers and views
+		// from before a Build() may no longer be valid after it
+		jpr::rcode Build();
+		void Clear();
+
+	public:
+		// Handle of a named image, or INVALID
+		uint32_t Find(const std::string& sName);
+		uint32_t Count();
+		// Where a handle was packed, nPage is -1 until it has been built
+		sRegion GetRegion(uint32_t nHandle);
+		SpriteView GetView(uint32_t nHandle);
+		int32_t GetPageCount();
+		Sprite* GetPage(int32_t nPage);
+
+	public:
+		// The pages are stored as .spr entries sName#0, sName#1 and so on, and the
+		// index of names and regions as sName. Builds first if anything is pending
+		jpr::rcode SaveToPack(jpr::ResourcePack* pack, std::string sName);
+		jpr::rcode LoadFromPack(jpr::ResourcePack* pack, std::string sName);
+
+	private:
+		// The top of the packed area across [x,x+w) is at y
+		struct sSegment { int32_t x, y, w; };
+		struct sPage
+		{
+			Sprite* pSprite = nullptr;
+			std::vector<sSegment> vSkyline;
+			bool bFull = false;
+		};
+		struct sImage
+		{
+			std::string sName;
+			sRegion r;
+			// Copied pixels waiting for Build(), packed rows
+			std::vector<Pixel> vPending;
+		};
+
+		int32_t nPageWidth;
+		int32_t nPageHeight;
+		int32_t nPadding;
+		std::vector<sPage> vPages;
+		std::vector<sImage> vImages;
+		std::map<std::string, uint32_t> mapNames;
+		std::vector<uint32_t> vPending;
+
+		bool jpr_Place(sPage& page, int32_t w, int32_t h, int32_t& x, int32_t& y);
+	};
+
+	// Composites n source pixels over n destination pixels, the same as the
+	// ALPHA pixel mode: source alpha scaled by fBlend weights the colour, and
+	// the destination alpha accumulates rather than being overwritten
+	void BlendSpan(Pixel* pDest, const Pixel* pSource, int32_t n, float fBlend = 1.0f);
+	// Composites a single colour over n destination pixels
+	void BlendSpan(Pixel* pDest, Pixel pSource, int32_t n, float fBlend = 1.0f);
+
 	enum Key
 	{
 		NONE,
@@ -277,14 +568,91 @@ namespace jpr
 		NP_MUL, NP_DIV, NP_ADD, NP_SUB, NP_DECIMAL,
 	};
 
+	// A recorded sequence of draw calls, see RetroGameEngine::BeginDisplayList()
+	class DisplayList
+	{
+	public:
+		DisplayList() = default;
+		~DisplayList();
+		DisplayList(const DisplayList&) = delete;
+		DisplayList& operator=(const DisplayList&) = delete;
+
+	public:
+		// Number of draw calls recorded
+		uint32_t Size();
+		// Removes every recorded draw call
+		void Clear();
+		// Lets a list that is drawn again unchanged be flattened into a sprite, and
+		// drawn as that from then on. This only happens if every call was made in
+		// MASK mode, or in NORMAL mode with an opaque colour and no sprites, as
+		// then the result does not depend on what it is drawn over. Re-recording
+		// the same calls keeps the cache, only different calls drop it
+		void SetCaching(bool bEnable);
+		// Drops the cached sprite, for when a sprite the list draws has changed.
+		// Only the calls are compared when re-recording, not sprite contents
+		void Invalidate();
+
+	private:
+		friend class RetroGameEngine;
+		enum
+		{
+			CMD_DRAW, CMD_DRAWLINE, CMD_DRAWCIRCLE, CMD_FILLCIRCLE, CMD_FILLRECT, CMD_FILLTRIANGLE,
+			CMD_DRAWSPRITE, CMD_DRAWPARTIALSPRITE, CMD_DRAWSTRING, CMD_SHADETRIANGLE
+		};
+		struct sState
+		{
+			Pixel::Mode nMode;
+			float fBlend;
+			// Which SetPixelMode() call the custom function came from
+			uint32_t nFuncVersion;
+			std::function<jpr::Pixel(const int x, const int y, const jpr::Pixel&, const jpr::Pixel&)> funcPixelMode;
+		};
+		struct sCommand
+		{
+			int32_t nType;
+			uint32_t nState;
+			// Bounds of what the command may write, [x0,x1) x [y0,y1)
+			int32_t x0, y0, x1, y1;
+			int32_t v[6];
+			// Line pattern, circle mask, scale or first of three vColours
+			uint32_t n;
+			uint8_t nFlip;
+			Pixel p;
+			// What sprite commands draw, view is used when there is no pSprite
+			Sprite* pSprite;
+			SpriteView view;
+#ifdef JPR_DBG_OVERDRAW
+			int nPrimitive;
+#endif
+		};
+		std::vector<sState> vStates;
+		std::vector<sCommand> vCommands;
+		std::vector<std::string> vText;
+		std::vector<Pixel> vColours;
+		// True if other holds exactly the same calls as this list
+		bool jpr_SameCalls(const DisplayList& other) const;
+		bool		bCaching = false;
+		bool		bCacheable = true;
+		uint32_t	nDraws = 0;
+		Sprite*		pCache = nullptr;
+		int32_t		nCacheX = 0;
+		int32_t		nCacheY = 0;
+	};
+
 	class RetroGameEngine
 	{
 	public:
 		RetroGameEngine();
+		virtual ~RetroGameEngine();
 
 	public:
 		jpr::rcode	Construct(uint32_t screen_w, uint32_t screen_h, uint32_t pixel_w, uint32_t pixel_h, bool full_screen = false, bool vsync = false);
 		jpr::rcode	Start();
+		// Runs the engine without a window or OpenGL context. Frames are only
+		// rendered into the default draw target, OnUserUpdate() receives a fixed
+		// fElapsedTime (or the measured frame time if fElapsedTime <= 0) and the
+		// loop runs as fast as possible for nFrames frames (0 = until the user quits)
+		jpr::rcode	StartHeadless(uint32_t nFrames = 0, float fElapsedTime = 1.0f / 60.0f);
 
 	// Override Interfaces
 	public:
@@ -294,6 +662,9 @@ namespace jpr
 		virtual bool OnUserUpdate(float fElapsedTime);
 		// Called once on application termination, so you can be a clean coder
 		virtual bool OnUserDestroy();
+		// Called at a fixed rate before OnUserUpdate() when SetFixedTimestep() is
+		// in use, fFixedElapsedTime is always the same
+		virtual bool OnUserFixedUpdate(float fFixedElapsedTime);
 
 	public: // Hardware Interfaces
 		// Returns true if window is currently in focus
@@ -321,12 +692,18 @@ namespace jpr
 		int32_t GetDrawTargetHeight();
 		// Returns the currently active draw target
 		Sprite* GetDrawTarget();
+		// Returns true if the engine was started with StartHeadless()
+		bool IsHeadless();
 
 	// Draw Routines
 	public:
 		// Specify which Sprite should be the target of drawing functions, use nullptr
 		// to specify the primary screen
 		void SetDrawTarget(Sprite *target);
+		// Draw into the pixels of a view instead, such as an area of a sprite or of
+		// the screen. Views of the screen are only valid for the frame they are
+		// taken in, and drawing through them marks the screen dirty
+		void SetDrawTarget(const SpriteView& target);
 		// Change the pixel mode for different optimisations
 
 		// jpr::Pixel::NORMAL = No transparency
@@ -341,10 +718,17 @@ namespace jpr
 		// Offset texels by sub-pixel amount (advanced, do not use)
 		void SetSubPixelOffset(float ox, float oy);
 
-		// Draws a single Pixel
+		// Draws a single Pixel. The other draw routines write to the draw target
+		// directly, so overriding this does not affect them
 		virtual bool Draw(int32_t x, int32_t y, Pixel p = jpr::WHITE);
 		// Draws a line from (x1,y1) to (x2,y2)
 		void DrawLine(int32_t x1, int32_t y1, int32_t x2, int32_t y2, Pixel p = jpr::WHITE, uint32_t pattern = 0xFFFFFFFF);
+		// Draws a line between each pair of points, (0,1), (2,3) and so on. Every
+		// segment is drawn exactly as DrawLine() would draw it
+		void DrawLines(const std::vector<jpr::vi2d>& vPoints, Pixel p = jpr::WHITE, uint32_t pattern = 0xFFFFFFFF);
+		// Draws lines joining consecutive points, and the last point back to the
+		// first if bClosed
+		void DrawPolyline(const std::vector<jpr::vi2d>& vPoints, Pixel p = jpr::WHITE, uint32_t pattern = 0xFFFFFFFF, bool bClosed = false);
 		// Draws a circle located at (x,y) with radius
 		void DrawCircle(int32_t x, int32_t y, int32_t radius, Pixel p = jpr::WHITE, uint8_t mask = 0xFF);
 		// Fills a circle located at (x,y) with radius
@@ -355,20 +739,149 @@ namespace jpr
 		void FillRect(int32_t x, int32_t y, int32_t w, int32_t h, Pixel p = jpr::WHITE);
 		// Draws a triangle between points (x1,y1), (x2,y2) and (x3,y3)
 		void DrawTriangle(int32_t x1, int32_t y1, int32_t x2, int32_t y2, int32_t x3, int32_t y3, Pixel p = jpr::WHITE);
-		// Flat fills a triangle between points (x1,y1), (x2,y2) and (x3,y3)
+		// Flat fills a triangle between points (x1,y1), (x2,y2) and (x3,y3). Pixels on
+		// the top and left edges are filled and those on the other edges are not, so
+		// triangles sharing an edge never fill a pixel twice
 		void FillTriangle(int32_t x1, int32_t y1, int32_t x2, int32_t y2, int32_t x3, int32_t y3, Pixel p = jpr::WHITE);
-		// Draws an entire sprite at location (x,y)
-		void DrawSprite(int32_t x, int32_t y, Sprite *sprite, uint32_t scale = 1);
+		// Fills the triangles vIndices[3i], vIndices[3i+1], vIndices[3i+2] of a mesh in
+		// one call, with the same fill rule as FillTriangle(). vColours holds one
+		// colour per triangle, or with bVertexColours one per vertex that is shaded
+		// smoothly across each triangle. A single colour is used for everything
+		void FillTriangles(const std::vector<jpr::vi2d>& vVertices, const std::vector<uint32_t>& vIndices, const std::vector<Pixel>& vColours, bool bVertexColours = false);
+		// Draws an entire sprite at location (x,y), flip is a combination of
+		// jpr::Sprite::HORIZ and jpr::Sprite::VERT
+		void DrawSprite(int32_t x, int32_t y, Sprite *sprite, uint32_t scale = 1, uint8_t flip = jpr::Sprite::NONE);
 		// Draws an area of a sprite at location (x,y), where the
 		// selected area is (ox,oy) to (ox+w,oy+h)
-		void DrawPartialSprite(int32_t x, int32_t y, Sprite *sprite, int32_t ox, int32_t oy, int32_t w, int32_t h, uint32_t scale = 1);
+		void DrawPartialSprite(int32_t x, int32_t y, Sprite *sprite, int32_t ox, int32_t oy, int32_t w, int32_t h, uint32_t scale = 1, uint8_t flip = jpr::Sprite::NONE);
+		// As above for pixels held in a view, which are always sampled as
+		// jpr::Sprite::NORMAL. The memory must stay valid until the draw is done,
+		// which with deferred drawing is the end of the frame
+		void DrawSprite(int32_t x, int32_t y, const SpriteView& view, uint32_t scale = 1, uint8_t flip = jpr::Sprite::NONE);
+		void DrawPartialSprite(int32_t x, int32_t y, const SpriteView& view, int32_t ox, int32_t oy, int32_t w, int32_t h, uint32_t scale = 1, uint8_t flip = jpr::Sprite::NONE);
 		// Draws a single line of text
 		void DrawString(int32_t x, int32_t y, std::string sText, Pixel col = jpr::WHITE, uint32_t scale = 1);
+		// Draws text like DrawString(), but each distinct text, colour and scale is
+		// rendered once into a sprite that is blitted on later calls
+		void DrawStringCached(int32_t x, int32_t y, const std::string& sText, Pixel col = jpr::WHITE, uint32_t scale = 1);
+		// Returns the area in pixels DrawString() covers, lines are split at '\n'
+		jpr::vi2d GetTextSize(const std::string& sText, uint32_t scale = 1);
+		// Renders text into a new, otherwise transparent sprite of GetTextSize(),
+		// owned by the caller. Returns nullptr if the text covers no pixels
+		Sprite* CreateTextSprite(const std::string& sText, Pixel col = jpr::WHITE, uint32_t scale = 1);
+		// Limits the memory DrawStringCached() keeps, the least recently drawn
+		// strings are discarded first. Use 0 to disable the cache
+		void SetTextCacheBudget(size_t nBytes);
+		// Discards every string held by DrawStringCached()
+		void ClearTextCache();
 		// Clears entire draw target to Pixel
 		void Clear(Pixel p);
 		// Resize the primary screen sprite
 		void SetScreenSize(int w, int h);
 
+	// Frame Timing
+	public:
+		// Calls OnUserFixedUpdate() fHz times per second of elapsed time, zero or
+		// more times per frame, with leftover time carried to the next frame. Use
+		// 0 to disable
+		void SetFixedTimestep(float fHz);
+		// How far between the last and the next fixed update this frame is, in
+		// the range 0 to 1, for interpolating what is rendered
+		float GetInterpolation();
+		// Caps the frame rate, sleeping then spinning until each frame is due. Use
+		// 0 to run as fast as possible. Not applied when headless
+		void SetFrameRateLimit(float fFPS);
+
+	// Frame Statistics
+	public:
+		// Times each phase of every frame (event pump, input, updates, texture
+		// upload, swap) and keeps the last nHistory frames. If sCSVFile is given
+		// every frame is streamed to it too, if it cannot be opened FAIL is
+		// returned and stats stay off. With SetThreadedPresent() only the game
+		// thread's phases are recorded
+		jpr::rcode EnableFrameStats(uint32_t nHistory = 600, std::string sCSVFile = "");
+		void DisableFrameStats();
+		// The recorded statistics, or nullptr if they are not enabled
+		FrameStats* GetFrameStats();
+
+	// Screen Upload
+	public:
+		// Streams each frame to the GPU through nBuffers (2 or more) pixel buffer
+		// objects, so the driver's copy overlaps the next frame instead of stalling
+		// the game thread. Call before Start(). If the driver lacks buffer objects
+		// the plain synchronous upload is used
+		void SetAsyncUpload(bool bEnable, uint32_t nBuffers = 2);
+
+		// Runs OnUserUpdate() on its own thread, drawing into one of three screen
+		// buffers, while the OpenGL thread uploads and swaps the most recently
+		// completed frame. Blocking swaps (vsync) then no longer hold up the
+		// simulation. Call before Start(). SetScreenSize() is ignored while
+		// running in this mode, and dirty rectangle tracking is not used
+		void SetThreadedPresent(bool bEnable);
+
+	// Display Lists
+	public:
+		// Until EndDisplayList(), every draw routine except Clear() is recorded into
+		// list (replacing what it held) instead of being drawn. Pixel mode and blend
+		// are recorded with each call, the draw target is not. If the calls are the
+		// same as last time the list keeps its cached sprite, see SetCaching()
+		void BeginDisplayList(DisplayList* list);
+		void EndDisplayList();
+		// Draws everything recorded in list to the draw target, offset by (ox,oy).
+		// Sprites the list draws are used as they are now
+		void DrawDisplayList(DisplayList* list, int32_t ox = 0, int32_t oy = 0);
+
+	// Deferred Rendering
+	public:
+		// Until EndDeferred(), every draw routine except Clear() is recorded instead
+		// of drawn. EndDeferred() then sorts the commands into nTileSize square
+		// tiles of the draw target and rasterises the tiles in parallel. Each tile
+		// replays its commands in the order they were issued, so the result is the
+		// same as drawing immediately. Clear(), or changing the draw target, first
+		// rasterises what has been recorded. Sprites drawn must not change until
+		// then, and a custom pixel mode must be safe to call from several threads.
+		// Recording ends with the frame if EndDeferred() is not called
+		void BeginDeferred(uint32_t nTileSize = 64);
+		void EndDeferred();
+		// Threads used to rasterise deferred commands, including the calling
+		// thread. 0 uses one per hardware thread
+		void SetRenderThreads(uint32_t nThreads = 0);
+
+	// Dirty Rectangles
+	public:
+		// When enabled, the draw routines record which regions of the primary
+		// screen they touch, and only those regions are uploaded each frame.
+		// Nothing is uploaded for frames that draw nothing
+		void SetDirtyRectTracking(bool bEnable);
+		// Marks a region of the primary screen as changed, for code that writes
+		// to it directly through GetData() or Sprite::SetPixel()
+		void MarkDirty(int32_t x, int32_t y, int32_t w, int32_t h);
+
+#ifdef JPR_DBG_OVERDRAW
+	// Overdraw Diagnostics
+	public:
+		enum DbgPrimitive
+		{
+			DBG_DRAW, DBG_DRAWLINE, DBG_DRAWCIRCLE, DBG_FILLCIRCLE, DBG_DRAWRECT, DBG_FILLRECT,
+			DBG_DRAWTRIANGLE, DBG_FILLTRIANGLE, DBG_DRAWSPRITE, DBG_DRAWPARTIALSPRITE,
+			DBG_DRAWSTRING, DBG_CLEAR, DBG_OTHER, DBG_PRIMITIVE_COUNT
+		};
+		// Pixels written by each draw routine this frame, to any draw target. Pixels
+		// written by nested calls, like the lines of DrawRect(), count towards the
+		// outermost routine
+		uint64_t GetOverdrawPixels(DbgPrimitive p);
+		static const char* GetPrimitiveName(DbgPrimitive p);
+		// Shades the primary screen by how many times each pixel was written this
+		// frame, from blue (once) to red (nMaxWrites or more). Call it last in
+		// OnUserUpdate(), pixels that were not written are left as they are
+		void DrawOverdrawHeatmap(float fOpacity = 0.75f, uint16_t nMaxWrites = 8);
+
+	private:
+		DbgPrimitive nDbgPrimitive = DBG_OTHER;
+		uint64_t	nDbgPrimitivePixels[DBG_PRIMITIVE_COUNT] = {};
+		friend struct jpr_DbgPrimitiveScope;
+#endif
+
 	// Branding
 	public:
 		std::string sAppName;
@@ -377,10 +890,17 @@ namespace jpr
 	private:
 		Sprite		*pDefaultDrawTarget = nullptr;
 		Sprite		*pDrawTarget = nullptr;
+		// Wraps the view given to SetDrawTarget(), and where it lies on the screen if it does
+		Sprite		sprViewTarget;
+		bool		bViewOnScreen = false;
+		int32_t		nViewTargetX = 0;
+		int32_t		nViewTargetY = 0;
 		Pixel::Mode	nPixelMode = Pixel::NORMAL;
 		float		fBlendFactor = 1.0f;
 		uint32_t	nScreenWidth = 256;
 		uint32_t	nScreenHeight = 240;
+		// Row pitch of the screen sprites, which the uploads read from
+		uint32_t	nScreenPitch = 256;
 		uint32_t	nPixelWidth = 4;
 		uint32_t	nPixelHeight = 4;
 		int32_t		nMousePosX = 0;
@@ -403,9 +923,77 @@ namespace jpr
 		bool		bHasInputFocus = false;
 		bool		bHasMouseFocus = false;
 		bool		bEnableVSYNC = false;
+		bool		bHeadless = false;
+		bool		bDirtyTracking = false;
+		struct sDirtyRect { int32_t x0, y0, x1, y1; };
+		static const int nMaxDirtyRects = 8;
+		sDirtyRect	vDirtyRects[nMaxDirtyRects];
+		int			nDirtyRects = 0;
+		bool		bAsyncUpload = false;
+		std::vector<GLuint> vUploadBuffers;
+		uint32_t	nUploadBuffers = 2;
+		uint32_t	nUploadBuffer = 0;
+
+		bool		bDeferred = false;
+		DisplayList	dlDeferred;
+		Sprite*		pDeferredTarget = nullptr;
+		// Where the draw routines are being recorded to instead of drawn, if anywhere
+		DisplayList* pRecording = nullptr;
+		DisplayList* pUserList = nullptr;
+		// User lists are recorded here first, so an unchanged list keeps its cache
+		DisplayList	dlUserRecord;
+		uint32_t	nPixelFuncVersion = 0;
+		// Indices of the commands touching each tile, in the order they were recorded
+		std::vector<std::vector<uint32_t>> vTileBins;
+		int32_t		nTileSize = 64;
+		int32_t		nTilesX = 0;
+		int32_t		nTiles = 0;
+		std::atomic<int32_t> nNextTile{ 0 };
+		uint32_t	nRenderThreads = 0;
+		std::vector<std::thread> vRenderWorkers;
+		std::mutex	muxRender;
+		std::condition_variable cvRenderStart;
+		std::condition_variable cvRenderDone;
+		uint64_t	nRenderJob = 0;
+		int			nRenderBusy = 0;
+		bool		bRenderQuit = false;
+		float		fFixedTimestep = 0.0f;
+		float		fFixedAccumulator = 0.0f;
+		float		fInterpolation = 0.0f;
+		std::chrono::steady_clock::duration tpFramePeriod{ 0 };
+		std::chrono::steady_clock::time_point tpNextFrame;
+		FrameStats*	pFrameStats = nullptr;
+		float		fPhaseTimes[FrameStats::PHASE_COUNT];
+		std::chrono::steady_clock::time_point tpFrameStart;
+		std::chrono::steady_clock::time_point tpPhaseStart;
+		bool		bThreadedPresent = false;
+		Sprite*		pFrameBuffers[3] = { nullptr, nullptr, nullptr };
+		int			nDrawBuffer = 0;
+		int			nPresentBuffer = 1;
+		// Index of the newest completed frame, with nFrameFresh set until it is presented
+		std::atomic<int> nReadyBuffer{ 2 };
+		static const int nBufferIndex = 0x3;
+		static const int nFrameFresh = 0x4;
+		std::atomic<bool> bGameRunning{ false };
+		std::atomic<int> nGameFPS{ -1 };
+		std::mutex	muxFrameReady;
+		std::condition_variable cvFrameReady;
 		float		fFrameTimer = 1.0f;
 		int			nFrameCount = 0;
 		Sprite		*fontSprite = nullptr;
+		// Font glyphs as 1-bit rows, bit i of nFontGlyphs[c - 32][j] is texel (i,j)
+		uint8_t		nFontGlyphs[96][8] = {};
+		// Strings rendered by DrawStringCached(), most recently drawn first
+		struct sTextRun
+		{
+			std::string sKey;
+			Sprite* pSprite;
+			size_t nBytes;
+		};
+		std::list<sTextRun> listTextRuns;
+		std::map<std::string, std::list<sTextRun>::iterator> mapTextRuns;
+		size_t		nTextCacheBytes = 0;
+		size_t		nTextCacheBudget = 4 * 1024 * 1024;
 		std::function<jpr::Pixel(const int x, const int y, const jpr::Pixel&, const jpr::Pixel&)> funcPixelMode;
 
 		static std::map<size_t, uint8_t> mapKeys;
@@ -416,6 +1004,9 @@ namespace jpr
 		bool		pMouseNewState[5]{ 0 };
 		bool		pMouseOldState[5]{ 0 };
 		HWButton	pMouseState[5];
+		// Guards the new states and mouse caches, the present thread writes them
+		// while the game thread takes its per frame snapshot
+		std::mutex	muxInput;
 
 #if defined(_WIN32)
 		HDC			glDeviceContext = nullptr;
@@ -429,6 +1020,9 @@ namespace jpr
 		GLuint		glBuffer;
 
 		void		EngineThread();
+		void		HeadlessThread(uint32_t nFrames, float fElapsedTime);
+		void		GameThread();
+		void		jpr_DestroyContextAndWindow();
 
 		// If anything sets this flag to false, the engine
 		// "should" shut down gracefully
@@ -439,8 +1033,44 @@ namespace jpr
 		void jpr_UpdateMouseWheel(int32_t delta);
 		void jpr_UpdateWindowSize(int32_t x, int32_t y);
 		void jpr_UpdateViewport();
+		void jpr_UpdateInputState();
+		// Everything that happens once per frame before drawing is displayed,
+		// returns false when the user wants to quit
+		bool jpr_UpdateFrame(float fElapsedTime);
+		void jpr_LimitFrameRate();
+		// Frame statistics - time since the previous lap is charged to phase p
+		void jpr_BeginFrameStats();
+		void jpr_LapFrameStats(FrameStats::Phase p);
+		void jpr_EndFrameStats();
+		// Records that the draw target region [x0,x1) x [y0,y1) is about to change
+		void jpr_MarkDirty(int32_t x0, int32_t y0, int32_t x1, int32_t y1);
+		void jpr_DrawSegments(const jpr::vi2d* pPoints, size_t nPoints, size_t nSegments, size_t nStride, Pixel p, uint32_t pattern);
+		void jpr_UploadRects(const Pixel* pScreen, const sDirtyRect* rects, int n);
+		void jpr_PresentFrame(const Pixel* pFrame, bool bFullFrame);
+		void jpr_HandleSystemEvents();
+		void jpr_UpdateTitle(int nFPS);
+		void jpr_PresentThread();
+		bool jpr_CreateUploadBuffers();
+		void jpr_DestroyUploadBuffers();
+		// Calls f once with the pixel writer for the current pixel mode and draw target
+		template<class F> void jpr_WithPixelWriter(F&& f);
+		// Calls f once with the pixel writer for mode m, confined to [x0,x1) x [y0,y1) of pTarget
+		template<class F> void jpr_WithPixelWriter(Sprite* pTarget, Pixel::Mode m, float fBlend, const std::function<jpr::Pixel(const int x, const int y, const jpr::Pixel&, const jpr::Pixel&)>* pFunc,
+			int32_t x0, int32_t y0, int32_t x1, int32_t y1, F&& f);
+		// Display lists and deferred rendering
+		void jpr_UpdateRecording();
+		uint32_t jpr_RecordState(Pixel::Mode m, float fBlend, uint32_t nFuncVersion, const std::function<jpr::Pixel(const int x, const int y, const jpr::Pixel&, const jpr::Pixel&)>& func);
+		DisplayList::sCommand& jpr_Record(int32_t nType, int32_t x0, int32_t y0, int32_t x1, int32_t y1);
+		void jpr_ReplayCommand(const DisplayList& dl, DisplayList::sCommand c, int32_t ox, int32_t oy);
+		bool jpr_FlattenDisplayList(DisplayList* dl);
+		void jpr_FlushDeferred();
+		void jpr_RasterTiles();
+		template<class W> void jpr_RasterCommand(const W& w, const DisplayList& dl, const DisplayList::sCommand& c);
+		void jpr_RenderWorker(uint64_t nJob);
+		void jpr_StopRenderWorkers();
 		bool jpr_OpenGLCreate();
 		void jpr_ConstructFontSheet();
+		void jpr_TrimTextCache(size_t nBudget);
 
 
 #if defined(_WIN32)
@@ -527,1055 +1157,3427 @@ namespace jpr
 		return n != p.n;
 	}
 
-#if defined(_WIN32)
-	std::wstring ConvertS2W(std::string s)
+	// Span blending - the ALPHA pixel mode kernels. Integer "over" compositing,
+	// 8 pixels per step with AVX2, 4 with SSE2, otherwise one at a time. All
+	// paths produce identical results
+	static inline uint32_t jpr_Div255(uint32_t t)
 	{
-#ifdef __MINGW32__
-		wchar_t *buffer = new wchar_t[s.length() + 1];
-		mbstowcs(buffer, s.c_str(), s.length());
-		buffer[s.length()] = L'\0';
-#else
-		int count = MultiByteToWideChar(CP_UTF8, 0, s.c_str(), -1, NULL, 0);
-		wchar_t* buffer = new wchar_t[count];
-		MultiByteToWideChar(CP_UTF8, 0, s.c_str(), -1, buffer, count);
-#endif
-		std::wstring w(buffer);
-		delete[] buffer;
-		return w;
+		// Rounded t / 255, exact for t <= 255 * 255
+		t += 128;
+		return (t + (t >> 8)) >> 8;
 	}
-#endif
 
-	Sprite::Sprite()
+	static inline uint32_t jpr_BlendFactor(float fBlend)
 	{
-		pColData = nullptr;
-		width = 0;
-		height = 0;
+		if (fBlend <= 0.0f) return 0;
+		if (fBlend >= 1.0f) return 255;
+		return (uint32_t)(fBlend * 255.0f + 0.5f);
 	}
 
-	Sprite::Sprite(std::string sImageFile)
+	static inline Pixel jpr_BlendPixel(Pixel s, Pixel d, uint32_t nBlend)
 	{
-		LoadFromFile(sImageFile);
+		uint32_t a = jpr_Div255(s.a * nBlend);
+		uint32_t c = 255 - a;
+		return Pixel((uint8_t)jpr_Div255(s.r * a + d.r * c),
+			(uint8_t)jpr_Div255(s.g * a + d.g * c),
+			(uint8_t)jpr_Div255(s.b * a + d.b * c),
+			(uint8_t)jpr_Div255(255 * a + d.a * c));
 	}
 
-	Sprite::Sprite(std::string sImageFile, jpr::ResourcePack *pack)
+#if defined(JPR_PGE_SSE2)
+	static inline __m128i jpr_Div255_SSE2(__m128i t)
 	{
-		LoadFromPGESprFile(sImageFile, pack);
+		t = _mm_add_epi16(t, _mm_set1_epi16(128));
+		return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
 	}
 
-	Sprite::Sprite(int32_t w, int32_t h)
+	// Blends two pixels widened to 16 bit lanes, a holds each pixel's alpha in all four of its lanes
+	static inline __m128i jpr_Blend2_SSE2(__m128i s, __m128i d, __m128i a)
 	{
-		if(pColData) delete[] pColData;
-		width = w;		height = h;
-		pColData = new Pixel[width * height];
-		for (int32_t i = 0; i < width*height; i++)
-			pColData[i] = Pixel();
+		__m128i c = _mm_sub_epi16(_mm_set1_epi16(255), a);
+		return jpr_Div255_SSE2(_mm_add_epi16(_mm_mullo_epi16(s, a), _mm_mullo_epi16(d, c)));
 	}
 
-	Sprite::~Sprite()
+	static inline __m128i jpr_Alpha2_SSE2(__m128i s, __m128i nBlend)
 	{
-		if (pColData) delete pColData;
+		__m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+		return jpr_Div255_SSE2(_mm_mullo_epi16(a, nBlend));
 	}
+#endif
 
-	jpr::rcode Sprite::LoadFromPGESprFile(std::string sImageFile, jpr::ResourcePack *pack)
+#if defined(JPR_PGE_AVX2)
+	static inline __m256i jpr_Div255_AVX2(__m256i t)
 	{
-		if (pColData) delete[] pColData;
+		t = _mm256_add_epi16(t, _mm256_set1_epi16(128));
+		return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+	}
 
-		auto ReadData = [&](std::istream &is)
-		{
-			is.read((char*)&width, sizeof(int32_t));
-			is.read((char*)&height, sizeof(int32_t));
-			pColData = new Pixel[width * height];
-			is.read((char*)pColData, width * height * sizeof(uint32_t));
-		};
+	static inline __m256i jpr_Blend4_AVX2(__m256i s, __m256i d, __m256i a)
+	{
+		__m256i c = _mm256_sub_epi16(_mm256_set1_epi16(255), a);
+		return jpr_Div255_AVX2(_mm256_add_epi16(_mm256_mullo_epi16(s, a), _mm256_mullo_epi16(d, c)));
+	}
 
-		// These are essentially Memory Surfaces represented by jpr::Sprite
-		// which load very fast, but are completely uncompressed
-		if (pack == nullptr)
+	static inline __m256i jpr_Alpha4_AVX2(__m256i s, __m256i nBlend)
+	{
+		__m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+		return jpr_Div255_AVX2(_mm256_mullo_epi16(a, nBlend));
+	}
+#endif
+
+	void BlendSpan(Pixel* pDest, const Pixel* pSource, int32_t n, float fBlend)
+	{
+		uint32_t nBlend = jpr_BlendFactor(fBlend);
+		if (nBlend == 0) return;
+		int32_t i = 0;
+
+#if defined(JPR_PGE_AVX2)
 		{
-			std::ifstream ifs;
-			ifs.open(sImageFile, std::ifstream::binary);
-			if (ifs.is_open())
+			const __m256i zero = _mm256_setzero_si256();
+			const __m256i alphaLanes = _mm256_set1_epi64x(0x00FF000000000000ll);
+			const __m256i vBlend = _mm256_set1_epi16((short)nBlend);
+			const __m256i alphaBytes = _mm256_set1_epi32((int)0xFF000000);
+			for (; i + 8 <= n; i += 8)
 			{
-				ReadData(ifs);
-				return jpr::OK;
-			}
-			else
-				return jpr::FAIL;
-		}
-		else
-		{
-			auto streamBuffer = pack->GetStreamBuffer(sImageFile);
-			std::istream is(&streamBuffer);
-			ReadData(is);
-		}
+				__m256i s = _mm256_loadu_si256((const __m256i*)(pSource + i));
+				__m256i sa = _mm256_and_si256(s, alphaBytes);
 
+				// Fully transparent runs are common in sprites, fully opaque ones are a copy
+				if (_mm256_testz_si256(sa, sa)) continue;
+				if (nBlend == 255 && _mm256_movemask_epi8(_mm256_cmpeq_epi32(sa, alphaBytes)) == -1)
+				{
+					_mm256_storeu_si256((__m256i*)(pDest + i), s);
+					continue;
+				}
 
-		return jpr::FAIL;
+				__m256i d = _mm256_loadu_si256((const __m256i*)(pDest + i));
+				__m256i sLo = _mm256_unpacklo_epi8(s, zero), sHi = _mm256_unpackhi_epi8(s, zero);
+				__m256i aLo = jpr_Alpha4_AVX2(sLo, vBlend), aHi = jpr_Alpha4_AVX2(sHi, vBlend);
+				sLo = _mm256_or_si256(sLo, alphaLanes); sHi = _mm256_or_si256(sHi, alphaLanes);
+				__m256i rLo = jpr_Blend4_AVX2(sLo, _mm256_unpacklo_epi8(d, zero), aLo);
+				__m256i rHi = jpr_Blend4_AVX2(sHi, _mm256_unpackhi_epi8(d, zero), aHi);
+				_mm256_storeu_si256((__m256i*)(pDest + i), _mm256_packus_epi16(rLo, rHi));
+			}
 		}
+#endif
 
-	jpr::rcode Sprite::SaveToPGESprFile(std::string sImageFile)
-	{
-		if (pColData == nullptr) return jpr::FAIL;
-
-		std::ofstream ofs;
-		ofs.open(sImageFile, std::ifstream::binary);
-		if (ofs.is_open())
+#if defined(JPR_PGE_SSE2)
 		{
-			ofs.write((char*)&width, sizeof(int32_t));
-			ofs.write((char*)&height, sizeof(int32_t));
-			ofs.write((char*)pColData, width*height*sizeof(uint32_t));
-			ofs.close();
-			return jpr::OK;
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i alphaLanes = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+			const __m128i vBlend = _mm_set1_epi16((short)nBlend);
+			const __m128i alphaBytes = _mm_set1_epi32((int)0xFF000000);
+			for (; i + 4 <= n; i += 4)
+			{
+				__m128i s = _mm_loadu_si128((const __m128i*)(pSource + i));
+				__m128i sa = _mm_and_si128(s, alphaBytes);
+
+				if (_mm_movemask_epi8(_mm_cmpeq_epi32(sa, zero)) == 0xFFFF) continue;
+				if (nBlend == 255 && _mm_movemask_epi8(_mm_cmpeq_epi32(sa, alphaBytes)) == 0xFFFF)
+				{
+					_mm_storeu_si128((__m128i*)(pDest + i), s);
+					continue;
+				}
+
+				__m128i d = _mm_loadu_si128((const __m128i*)(pDest + i));
+				__m128i sLo = _mm_unpacklo_epi8(s, zero), sHi = _mm_unpackhi_epi8(s, zero);
+				__m128i aLo = jpr_Alpha2_SSE2(sLo, vBlend), aHi = jpr_Alpha2_SSE2(sHi, vBlend);
+				sLo = _mm_or_si128(sLo, alphaLanes); sHi = _mm_or_si128(sHi, alphaLanes);
+				__m128i rLo = jpr_Blend2_SSE2(sLo, _mm_unpacklo_epi8(d, zero), aLo);
+				__m128i rHi = jpr_Blend2_SSE2(sHi, _mm_unpackhi_epi8(d, zero), aHi);
+				_mm_storeu_si128((__m128i*)(pDest + i), _mm_packus_epi16(rLo, rHi));
+			}
 		}
+#endif
 
-		return jpr::FAIL;
+		for (; i < n; i++)
+			pDest[i] = jpr_BlendPixel(pSource[i], pDest[i], nBlend);
 	}
 
-	jpr::rcode Sprite::LoadFromFile(std::string sImageFile, jpr::ResourcePack *pack)
+	void BlendSpan(Pixel* pDest, Pixel pSource, int32_t n, float fBlend)
 	{
-		UNUSED(pack);
-#if defined(_WIN32)
-		// Use GDI+
-		std::wstring wsImageFile = ConvertS2W(sImageFile);
-        Gdiplus::Bitmap *bmp = Gdiplus::Bitmap::FromFile(wsImageFile.c_str());
-		if (bmp == nullptr)
-			return jpr::NO_FILE;
+		uint32_t nBlend = jpr_BlendFactor(fBlend);
+		uint32_t a = jpr_Div255(pSource.a * nBlend);
+		if (a == 0) return;
+		if (a == 255)
+		{
+			std::fill(pDest, pDest + n, Pixel(pSource.r, pSource.g, pSource.b, 255));
+			return;
+		}
 
-		width = bmp->GetWidth();
-		height = bmp->GetHeight();
-		pColData = new Pixel[width * height];
+		int32_t i = 0;
 
-		for(int x=0; x<width; x++)
-			for (int y = 0; y < height; y++)
+		// The source is constant, so its widened channels and alpha are set up once
+#if defined(JPR_PGE_AVX2)
+		{
+			const __m256i zero = _mm256_setzero_si256();
+			const __m256i s = _mm256_set_epi16(255, pSource.b, pSource.g, pSource.r, 255, pSource.b, pSource.g, pSource.r,
+				255, pSource.b, pSource.g, pSource.r, 255, pSource.b, pSource.g, pSource.r);
+			const __m256i va = _mm256_set1_epi16((short)a);
+			for (; i + 8 <= n; i += 8)
 			{
-				Gdiplus::Color c;
-				bmp->GetPixel(x, y, &c);
-				SetPixel(x, y, Pixel(c.GetRed(), c.GetGreen(), c.GetBlue(), c.GetAlpha()));
+				__m256i d = _mm256_loadu_si256((const __m256i*)(pDest + i));
+				__m256i rLo = jpr_Blend4_AVX2(s, _mm256_unpacklo_epi8(d, zero), va);
+				__m256i rHi = jpr_Blend4_AVX2(s, _mm256_unpackhi_epi8(d, zero), va);
+				_mm256_storeu_si256((__m256i*)(pDest + i), _mm256_packus_epi16(rLo, rHi));
 			}
-		delete bmp;
-		return jpr::OK;
+		}
 #endif
 
-#if defined(__linux__)
-		png_structp png;
-		png_infop info;
-
-		FILE *f = fopen(sImageFile.c_str(), "rb");
-		if (!f) return jpr::NO_FILE;
-
-		png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-		if (!png) goto fail_load;
-
-		info = png_create_info_struct(png);
-		if (!info) goto fail_load;
-
-		if (setjmp(png_jmpbuf(png))) goto fail_load;
-
-		png_init_io(png, f);
-		png_read_info(png, info);
-
-		png_byte color_type;
-		png_byte bit_depth;
-		png_bytep *row_pointers;
-		width = png_get_image_width(png, info);
-		height = png_get_image_height(png, info);
-		color_type = png_get_color_type(png, info);
-		bit_depth = png_get_bit_depth(png, info);
-
-#ifdef _DEBUG
-		std::cout << "Loading PNG: " << sImageFile << "\n";
-		std::cout << "W:" << width << " H:" << height << " D:" << (int)bit_depth << "\n";
+#if defined(JPR_PGE_SSE2)
+		{
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i s = _mm_set_epi16(255, pSource.b, pSource.g, pSource.r, 255, pSource.b, pSource.g, pSource.r);
+			const __m128i va = _mm_set1_epi16((short)a);
+			for (; i + 4 <= n; i += 4)
+			{
+				__m128i d = _mm_loadu_si128((const __m128i*)(pDest + i));
+				__m128i rLo = jpr_Blend2_SSE2(s, _mm_unpacklo_epi8(d, zero), va);
+				__m128i rHi = jpr_Blend2_SSE2(s, _mm_unpackhi_epi8(d, zero), va);
+				_mm_storeu_si128((__m128i*)(pDest + i), _mm_packus_epi16(rLo, rHi));
+			}
+		}
 #endif
 
-		if (bit_depth == 16) png_set_strip_16(png);
-		if (color_type == PNG_COLOR_TYPE_PALETTE) png_set_palette_to_rgb(png);
-		if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)	png_set_expand_gray_1_2_4_to_8(png);
-		if (png_get_valid(png, info, PNG_INFO_tRNS)) png_set_tRNS_to_alpha(png);
-		if (color_type == PNG_COLOR_TYPE_RGB ||
-			color_type == PNG_COLOR_TYPE_GRAY ||
-			color_type == PNG_COLOR_TYPE_PALETTE)
-			png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
-		if (color_type == PNG_COLOR_TYPE_GRAY ||
-			color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
-			png_set_gray_to_rgb(png);
+		for (; i < n; i++)
+			pDest[i] = jpr_BlendPixel(pSource, pDest[i], nBlend);
+	}
 
-		png_read_update_info(png, info);
-		row_pointers = (png_bytep*)malloc(sizeof(png_bytep) * height);
-		for (int y = 0; y < height; y++) {
-			row_pointers[y] = (png_byte*)malloc(png_get_rowbytes(png, info));
-		}
-		png_read_image(png, row_pointers);
+	// The MASK pixel mode's copy, only opaque source pixels are written
+	static inline void jpr_MaskCopySpan(Pixel* pDest, const Pixel* pSource, int32_t n)
+	{
+		int32_t i = 0;
 
-		// Create sprite array
-		pColData = new Pixel[width * height];
+#if defined(JPR_PGE_AVX2)
+		{
+			const __m256i alphaBytes = _mm256_set1_epi32((int)0xFF000000);
+			for (; i + 8 <= n; i += 8)
+			{
+				__m256i s = _mm256_loadu_si256((const __m256i*)(pSource + i));
+				__m256i m = _mm256_cmpeq_epi32(_mm256_and_si256(s, alphaBytes), alphaBytes);
+				int nMask = _mm256_movemask_epi8(m);
+				if (nMask == 0) continue;
+				if (nMask != -1)
+					s = _mm256_blendv_epi8(_mm256_loadu_si256((const __m256i*)(pDest + i)), s, m);
+				_mm256_storeu_si256((__m256i*)(pDest + i), s);
+			}
+		}
+#endif
 
-		// Iterate through image rows, converting into sprite format
-		for (int y = 0; y < height; y++)
+#if defined(JPR_PGE_SSE2)
 		{
-			png_bytep row = row_pointers[y];
-			for (int x = 0; x < width; x++)
+			const __m128i alphaBytes = _mm_set1_epi32((int)0xFF000000);
+			for (; i + 4 <= n; i += 4)
 			{
-				png_bytep px = &(row[x * 4]);
-				SetPixel(x, y, Pixel(px[0], px[1], px[2], px[3]));
+				__m128i s = _mm_loadu_si128((const __m128i*)(pSource + i));
+				__m128i m = _mm_cmpeq_epi32(_mm_and_si128(s, alphaBytes), alphaBytes);
+				int nMask = _mm_movemask_epi8(m);
+				if (nMask == 0) continue;
+				if (nMask != 0xFFFF)
+					s = _mm_or_si128(_mm_and_si128(m, s), _mm_andnot_si128(m, _mm_loadu_si128((const __m128i*)(pDest + i))));
+				_mm_storeu_si128((__m128i*)(pDest + i), s);
 			}
 		}
+#endif
 
-		fclose(f);
-		return jpr::OK;
+		for (; i < n; i++)
+			if (pSource[i].a == 255) pDest[i] = pSource[i];
+	}
 
-	fail_load:
-		width = 0;
-		height = 0;
-		fclose(f);
-		pColData = nullptr;
-		return jpr::FAIL;
+#if defined(_WIN32)
+	std::wstring ConvertS2W(std::string s)
+	{
+#ifdef __MINGW32__
+		wchar_t *buffer = new wchar_t[s.length() + 1];
+		mbstowcs(buffer, s.c_str(), s.length());
+		buffer[s.length()] = L'\0';
+#else
+		int count = MultiByteToWideChar(CP_UTF8, 0, s.c_str(), -1, NULL, 0);
+		wchar_t* buffer = new wchar_t[count];
+		MultiByteToWideChar(CP_UTF8, 0, s.c_str(), -1, buffer, count);
 #endif
+		std::wstring w(buffer);
+		delete[] buffer;
+		return w;
 	}
+#endif
 
-	void Sprite::SetSampleMode(jpr::Sprite::Mode mode)
+	// Over-allocates by 64 bytes, the byte before each aligned block holds how
+	// far back the real allocation starts
+	class jpr_HeapSpriteAllocator : public SpriteAllocator
 	{
-		modeSample = mode;
+	public:
+		void* Allocate(size_t nBytes) override
+		{
+			uint8_t* pRaw = new uint8_t[nBytes + 64];
+			uint8_t nOffset = (uint8_t)(64 - ((uintptr_t)pRaw & 63));
+			pRaw[nOffset - 1] = nOffset;
+			return pRaw + nOffset;
+		}
+
+		void Free(void* p, size_t nBytes) override
+		{
+			UNUSED(nBytes);
+			if (p == nullptr) return;
+			uint8_t* pBlock = (uint8_t*)p;
+			delete[] (pBlock - pBlock[-1]);
+		}
+	};
+
+	SpriteAllocator* SpriteAllocator::Heap()
+	{
+		static jpr_HeapSpriteAllocator heap;
+		return &heap;
 	}
 
+	SpritePoolAllocator::SpritePoolAllocator(size_t nSlabBytes, size_t nMaxBlock)
+	{
+		this->nSlabBytes = nSlabBytes;
+		this->nMaxBlock = nMaxBlock;
+	}
 
-	Pixel Sprite::GetPixel(int32_t x, int32_t y)
+	SpritePoolAllocator::~SpritePoolAllocator()
 	{
-		if (modeSample == jpr::Sprite::Mode::NORMAL)
+		for (auto p : vSlabs) Heap()->Free(p, 0);
+	}
+
+	void* SpritePoolAllocator::Allocate(size_t nBytes)
+	{
+		if (nBytes > nMaxBlock) return Heap()->Allocate(nBytes);
+		int c = nMinClass;
+		while (((size_t)1 << c) < nBytes) c++;
+		size_t nBlock = (size_t)1 << c;
+
+		std::unique_lock<std::mutex> lock(mux);
+		if ((int)vFree.size() <= c - nMinClass) vFree.resize(c - nMinClass + 1);
+		std::vector<void*>& v = vFree[c - nMinClass];
+		if (v.empty())
 		{
-			if (x >= 0 && x < width && y >= 0 && y < height)
-				return pColData[y*width + x];
-			else
-				return Pixel(0, 0, 0, 0);
+			// Carve a new slab into blocks of this class, which stay 64 byte aligned
+			size_t nSlab = std::max(nSlabBytes, nBlock) / nBlock * nBlock;
+			uint8_t* pSlab = (uint8_t*)Heap()->Allocate(nSlab);
+			vSlabs.push_back(pSlab);
+			for (size_t o = nSlab; o > 0; o -= nBlock)
+				v.push_back(pSlab + o - nBlock);
 		}
-		else
+		void* p = v.back();
+		v.pop_back();
+		return p;
+	}
+
+	void SpritePoolAllocator::Free(void* p, size_t nBytes)
+	{
+		if (p == nullptr) return;
+		if (nBytes > nMaxBlock) { Heap()->Free(p, nBytes); return; }
+		int c = nMinClass;
+		while (((size_t)1 << c) < nBytes) c++;
+
+		std::unique_lock<std::mutex> lock(mux);
+		vFree[c - nMinClass].push_back(p);
+	}
+
+	SpriteArenaAllocator::SpriteArenaAllocator(size_t nChunkBytes)
+	{
+		this->nChunkBytes = nChunkBytes;
+	}
+
+	SpriteArenaAllocator::~SpriteArenaAllocator()
+	{
+		for (auto& c : vChunks) Heap()->Free(c.pData, c.nSize);
+	}
+
+	void* SpriteArenaAllocator::Allocate(size_t nBytes)
+	{
+		// Whole cache lines, so the next block is aligned too
+		nBytes = (nBytes + 63) & ~(size_t)63;
+
+		std::unique_lock<std::mutex> lock(mux);
+		while (nChunk < vChunks.size() && nOffset + nBytes > vChunks[nChunk].nSize)
+		{
+			nChunk++;
+			nOffset = 0;
+		}
+		if (nChunk == vChunks.size())
 		{
-			return pColData[abs(y%height)*width + abs(x%width)];
+			size_t nSize = std::max(nChunkBytes, nBytes);
+			vChunks.push_back({ (uint8_t*)Heap()->Allocate(nSize), nSize });
+			nOffset = 0;
 		}
+		void* p = vChunks[nChunk].pData + nOffset;
+		nOffset += nBytes;
+		nUsed += nBytes;
+		return p;
 	}
 
-	bool Sprite::SetPixel(int32_t x, int32_t y, Pixel p)
+	void SpriteArenaAllocator::Free(void* p, size_t nBytes)
+	{
+		// Nothing is given back until Reset()
+		UNUSED(p); UNUSED(nBytes);
+	}
+
+	void SpriteArenaAllocator::Reset()
+	{
+		std::unique_lock<std::mutex> lock(mux);
+		nChunk = 0;
+		nOffset = 0;
+		nUsed = 0;
+	}
+
+	size_t SpriteArenaAllocator::Used()
+	{
+		std::unique_lock<std::mutex> lock(mux);
+		return nUsed;
+	}
+
+	Sprite::Sprite()
 	{
+		pColData = nullptr;
+		width = 0;
+		height = 0;
+	}
+
+	Sprite::Sprite(std::string sImageFile)
+	{
+		LoadFromFile(sImageFile);
+	}
+
+	Sprite::Sprite(std::string sImageFile, jpr::ResourcePack *pack)
+	{
+		LoadFromPGESprFile(sImageFile, pack);
+	}
+
+	Sprite::Sprite(int32_t w, int32_t h, SpriteAllocator* pAllocator)
+	{
+		jpr_Create(w, h, pAllocator);
+		std::fill(pColData, pColData + nPitch * height, Pixel());
+	}
+
+	Sprite::~Sprite()
+	{
+		jpr_Destroy();
+	}
+
+	Sprite::Sprite(Sprite&& other) noexcept
+	{
+		*this = std::move(other);
+	}
 
+	Sprite& Sprite::operator=(Sprite&& other) noexcept
+	{
+		if (this == &other) return *this;
+		// Once emptied, swapping leaves other empty
+		jpr_Destroy();
+		std::swap(pColData, other.pColData);
+		std::swap(pAllocator, other.pAllocator);
+		std::swap(nAllocBytes, other.nAllocBytes);
+		std::swap(width, other.width);
+		std::swap(height, other.height);
+		std::swap(nPitch, other.nPitch);
+		modeSample = other.modeSample;
 #ifdef JPR_DBG_OVERDRAW
-		nOverdrawCount++;
+		vOverdraw.swap(other.vOverdraw);
 #endif
+		return *this;
+	}
 
-		if (x >= 0 && x < width && y >= 0 && y < height)
+	void Sprite::SetDefaultAllocator(SpriteAllocator* pAllocator)
+	{
+		pDefaultAllocator = pAllocator;
+	}
+
+	SpriteAllocator* Sprite::GetDefaultAllocator()
+	{
+		return pDefaultAllocator ? pDefaultAllocator : SpriteAllocator::Heap();
+	}
+
+	void Sprite::jpr_Create(int32_t w, int32_t h, SpriteAllocator* pFrom)
+	{
+		jpr_Destroy();
+		width = std::max(w, 0);		height = std::max(h, 0);
+		nPitch = (width + 7) & ~7;
+
+		// The block is 64 byte aligned, with the padded pitch every row then starts 32 byte aligned
+		pAllocator = pFrom ? pFrom : GetDefaultAllocator();
+		nAllocBytes = (size_t)nPitch * height * sizeof(Pixel);
+		pColData = (Pixel*)pAllocator->Allocate(nAllocBytes);
+	}
+
+	void Sprite::jpr_Wrap(const SpriteView& view)
+	{
+		jpr_Destroy();
+		pColData = view.pData;
+		width = view.width;		height = view.height;
+		nPitch = view.pitch;
+	}
+
+	void Sprite::jpr_Destroy()
+	{
+		if (pAllocator) pAllocator->Free(pColData, nAllocBytes);
+		pAllocator = nullptr;
+		nAllocBytes = 0;
+		pColData = nullptr;
+		width = 0;		height = 0;
+		nPitch = 0;
+	}
+
+	jpr::rcode Sprite::LoadFromPGESprFile(std::string sImageFile, jpr::ResourcePack *pack)
+	{
+		jpr_Destroy();
+
+		// The file holds tightly packed rows, read one at a time into the padded storage
+		auto ReadData = [&](std::istream &is)
 		{
-			pColData[y*width + x] = p;
-			return true;
+			int32_t w = 0, h = 0;
+			is.read((char*)&w, sizeof(int32_t));
+			is.read((char*)&h, sizeof(int32_t));
+			jpr_Create(w, h);
+			for (int32_t y = 0; y < height; y++)
+				is.read((char*)(pColData + y * nPitch), width * sizeof(uint32_t));
+		};
+
+		// These are essentially Memory Surfaces represented by jpr::Sprite
+		// which load very fast, but are completely uncompressed
+		if (pack == nullptr)
+		{
+			std::ifstream ifs;
+			ifs.open(sImageFile, std::ifstream::binary);
+			if (ifs.is_open())
+			{
+				ReadData(ifs);
+				return jpr::OK;
+			}
+			else
+				return jpr::FAIL;
 		}
 		else
-			return false;
+		{
+			auto streamBuffer = pack->GetStreamBuffer(sImageFile);
+			std::istream is(&streamBuffer);
+			ReadData(is);
+			if (is) return jpr::OK;
+		}
+
+
+		return jpr::FAIL;
+		}
+
+	jpr::rcode Sprite::SaveToPGESprFile(std::string sImageFile, jpr::ResourcePack *pack)
+	{
+		if (pColData == nullptr) return jpr::FAIL;
+
+		auto WriteData = [&](std::ostream &os)
+		{
+			os.write((char*)&width, sizeof(int32_t));
+			os.write((char*)&height, sizeof(int32_t));
+			for (int32_t y = 0; y < height; y++)
+				os.write((char*)(pColData + y * nPitch), width * sizeof(uint32_t));
+		};
+
+		if (pack != nullptr)
+		{
+			std::ostringstream oss(std::ios::binary);
+			WriteData(oss);
+			std::string sData = oss.str();
+			return pack->AddToPack(sImageFile, (const uint8_t*)sData.data(), (uint32_t)sData.size());
+		}
+
+		std::ofstream ofs;
+		ofs.open(sImageFile, std::ifstream::binary);
+		if (ofs.is_open())
+		{
+			WriteData(ofs);
+			ofs.close();
+			return jpr::OK;
+		}
+
+		return jpr::FAIL;
 	}
 
-	Pixel Sprite::Sample(float x, float y)
+#if defined(__linux__)
+	// libpng read callback for images held in memory
+	struct jpr_PNGMemory { const uint8_t* pData; size_t nSize; size_t nOffset; };
+	static void jpr_PNGReadMemory(png_structp png, png_bytep pOut, png_size_t n)
 	{
-		int32_t sx = std::min((int32_t)((x * (float)width)), width - 1);
-		int32_t sy = std::min((int32_t)((y * (float)height)), height - 1);
-		return GetPixel(sx, sy);
+		jpr_PNGMemory* m = (jpr_PNGMemory*)png_get_io_ptr(png);
+		if (n > m->nSize - m->nOffset) png_error(png, "Read past the end of the image");
+		std::copy(m->pData + m->nOffset, m->pData + m->nOffset + n, pOut);
+		m->nOffset += n;
 	}
+#endif
 
-	Pixel Sprite::SampleBL(float u, float v)
+	jpr::rcode Sprite::LoadFromFile(std::string sImageFile, jpr::ResourcePack *pack)
 	{
-		u = u * width - 0.5f;
-		v = v * height - 0.5f;
-		// cast to int rounds toward zero, not downward
-		int x = (int)floor(u);
-		int y = (int)floor(v);
-		float u_ratio = u - x;
-		float v_ratio = v - y;
-		float u_opposite = 1 - u_ratio;
-		float v_opposite = 1 - v_ratio;
+#if defined(_WIN32)
+		UNUSED(pack);
+		// Use GDI+
+		std::wstring wsImageFile = ConvertS2W(sImageFile);
+        Gdiplus::Bitmap *bmp = Gdiplus::Bitmap::FromFile(wsImageFile.c_str());
+		if (bmp == nullptr)
+			return jpr::NO_FILE;
 
-		jpr::Pixel p1 = GetPixel(std::max(x, 0), std::max(y, 0));
-		jpr::Pixel p2 = GetPixel(std::min(x + 1, (int)width - 1), std::max(y, 0));
-		jpr::Pixel p3 = GetPixel(std::max(x, 0), std::min(y + 1, (int)height - 1));
-		jpr::Pixel p4 = GetPixel(std::min(x + 1, (int)width - 1), std::min(y + 1, (int)height - 1));
+		jpr_Create(bmp->GetWidth(), bmp->GetHeight());
 
-		return jpr::Pixel(
-			(uint8_t)((p1.r * u_opposite + p2.r * u_ratio) * v_opposite + (p3.r * u_opposite + p4.r * u_ratio) * v_ratio),
-			(uint8_t)((p1.g * u_opposite + p2.g * u_ratio) * v_opposite + (p3.g * u_opposite + p4.g * u_ratio) * v_ratio),
-			(uint8_t)((p1.b * u_opposite + p2.b * u_ratio) * v_opposite + (p3.b * u_opposite + p4.b * u_ratio) * v_ratio));
+		for(int x=0; x<width; x++)
+			for (int y = 0; y < height; y++)
+			{
+				Gdiplus::Color c;
+				bmp->GetPixel(x, y, &c);
+				SetPixel(x, y, Pixel(c.GetRed(), c.GetGreen(), c.GetBlue(), c.GetAlpha()));
+			}
+		delete bmp;
+		return jpr::OK;
+#endif
+
+#if defined(__linux__)
+		png_structp png = nullptr;
+		png_infop info = nullptr;
+		jpr_PNGMemory mem = { nullptr, 0, 0 };
+
+		// Images in a pack are decoded straight out of its memory
+		if (pack != nullptr)
+		{
+			ResourcePack::sEntry e = pack->GetStreamBuffer(sImageFile);
+			if (e.data == nullptr) return jpr::NO_FILE;
+			mem.pData = e.data;
+			mem.nSize = e.nFileSize;
+		}
+
+		FILE *f = pack ? nullptr : fopen(sImageFile.c_str(), "rb");
+		if (!pack && !f) return jpr::NO_FILE;
+
+		png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+		if (!png) goto fail_load;
+
+		info = png_create_info_struct(png);
+		if (!info) goto fail_load;
+
+		if (setjmp(png_jmpbuf(png))) goto fail_load;
+
+		if (f) png_init_io(png, f);
+		else png_set_read_fn(png, &mem, jpr_PNGReadMemory);
+		png_read_info(png, info);
+
+		png_byte color_type;
+		png_byte bit_depth;
+		int nPasses;
+		color_type = png_get_color_type(png, info);
+		bit_depth = png_get_bit_depth(png, info);
+
+#ifdef _DEBUG
+		std::cout << "Loading PNG: " << sImageFile << "\n";
+		std::cout << "W:" << png_get_image_width(png, info) << " H:" << png_get_image_height(png, info) << " D:" << (int)bit_depth << "\n";
+#endif
+
+		if (bit_depth == 16) png_set_strip_16(png);
+		if (color_type == PNG_COLOR_TYPE_PALETTE) png_set_palette_to_rgb(png);
+		if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)	png_set_expand_gray_1_2_4_to_8(png);
+		if (png_get_valid(png, info, PNG_INFO_tRNS)) png_set_tRNS_to_alpha(png);
+		if (color_type == PNG_COLOR_TYPE_RGB ||
+			color_type == PNG_COLOR_TYPE_GRAY ||
+			color_type == PNG_COLOR_TYPE_PALETTE)
+			png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+		if (color_type == PNG_COLOR_TYPE_GRAY ||
+			color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+			png_set_gray_to_rgb(png);
+		nPasses = png_set_interlace_handling(png);
+
+		png_read_update_info(png, info);
+		if (png_get_rowbytes(png, info) != png_get_image_width(png, info) * sizeof(Pixel)) goto fail_load;
+
+		// The transforms above leave RGBA rows, the same layout as Pixel, so libpng
+		// writes each row straight into the sprite. Interlaced images take one
+		// sweep per pass, each filling in more of the same rows
+		jpr_Create(png_get_image_width(png, info), png_get_image_height(png, info));
+		for (int pass = 0; pass < nPasses; pass++)
+			for (int y = 0; y < height; y++)
+				png_read_row(png, (png_bytep)(pColData + y * nPitch), NULL);
+		png_read_end(png, NULL);
+
+		png_destroy_read_struct(&png, &info, NULL);
+		if (f) fclose(f);
+		return jpr::OK;
+
+	fail_load:
+		png_destroy_read_struct(&png, &info, NULL);
+		jpr_Destroy();
+		if (f) fclose(f);
+		return jpr::FAIL;
+#endif
+	}
+
+	jpr::rcode Sprite::LoadBatch(const std::vector<std::string>& vFiles, std::vector<Sprite>& vSprites, jpr::ResourcePack *pack, uint32_t nThreads)
+	{
+		vSprites.clear();
+		vSprites.resize(vFiles.size());
+		if (vFiles.empty()) return jpr::OK;
+		if (nThreads == 0) nThreads = std::max(std::thread::hardware_concurrency(), 1u);
+		nThreads = (uint32_t)std::min<size_t>(nThreads, vFiles.size());
+
+		// Each thread, the calling one included, takes the next file nobody has started
+		std::atomic<size_t> nNext{ 0 };
+		std::atomic<bool> bFailed{ false };
+		auto Work = [&]()
+		{
+			for (size_t i = nNext++; i < vFiles.size(); i = nNext++)
+				if (vSprites[i].LoadFromFile(vFiles[i], pack) != jpr::OK)
+					bFailed = true;
+		};
+
+		std::vector<std::thread> vWorkers;
+		for (uint32_t t = 1; t < nThreads; t++)
+			vWorkers.emplace_back(Work);
+		Work();
+		for (auto& t : vWorkers)
+			t.join();
+		return bFailed ? jpr::FAIL : jpr::OK;
+	}
+
+	void Sprite::SetSampleMode(jpr::Sprite::Mode mode)
+	{
+		modeSample = mode;
+	}
+
+
+	Sprite::Mode Sprite::GetSampleMode()
+	{
+		return modeSample;
+	}
+
+	Pixel Sprite::GetPixel(int32_t x, int32_t y)
+	{
+		if (modeSample == jpr::Sprite::Mode::NORMAL)
+		{
+			if (x >= 0 && x < width && y >= 0 && y < height)
+				return pColData[y*nPitch + x];
+			else
+				return Pixel(0, 0, 0, 0);
+		}
+		else
+		{
+			return pColData[abs(y%height)*nPitch + abs(x%width)];
+		}
+	}
+
+#ifdef JPR_DBG_OVERDRAW
+	uint16_t Sprite::GetOverdraw(int32_t x, int32_t y)
+	{
+		if (x < 0 || x >= width || y < 0 || y >= height || vOverdraw.empty())
+			return 0;
+		return vOverdraw[y*width + x];
+	}
+
+	void Sprite::ResetOverdraw()
+	{
+		std::fill(vOverdraw.begin(), vOverdraw.end(), 0);
+	}
+#endif
+
+	bool Sprite::SetPixel(int32_t x, int32_t y, Pixel p)
+	{
+
+#ifdef JPR_DBG_OVERDRAW
+		nOverdrawCount++;
+#endif
+
+		if (x >= 0 && x < width && y >= 0 && y < height)
+		{
+			pColData[y*nPitch + x] = p;
+			return true;
+		}
+		else
+			return false;
+	}
+
+	Pixel Sprite::Sample(float x, float y)
+	{
+		int32_t sx = std::min((int32_t)((x * (float)width)), width - 1);
+		int32_t sy = std::min((int32_t)((y * (float)height)), height - 1);
+		return GetPixel(sx, sy);
+	}
+
+	Pixel Sprite::SampleBL(float u, float v)
+	{
+		u = u * width - 0.5f;
+		v = v * height - 0.5f;
+		// cast to int rounds toward zero, not downward
+		int x = (int)floor(u);
+		int y = (int)floor(v);
+		float u_ratio = u - x;
+		float v_ratio = v - y;
+		float u_opposite = 1 - u_ratio;
+		float v_opposite = 1 - v_ratio;
+
+		jpr::Pixel p1 = GetPixel(std::max(x, 0), std::max(y, 0));
+		jpr::Pixel p2 = GetPixel(std::min(x + 1, (int)width - 1), std::max(y, 0));
+		jpr::Pixel p3 = GetPixel(std::max(x, 0), std::min(y + 1, (int)height - 1));
+		jpr::Pixel p4 = GetPixel(std::min(x + 1, (int)width - 1), std::min(y + 1, (int)height - 1));
+
+		return jpr::Pixel(
+			(uint8_t)((p1.r * u_opposite + p2.r * u_ratio) * v_opposite + (p3.r * u_opposite + p4.r * u_ratio) * v_ratio),
+			(uint8_t)((p1.g * u_opposite + p2.g * u_ratio) * v_opposite + (p3.g * u_opposite + p4.g * u_ratio) * v_ratio),
+			(uint8_t)((p1.b * u_opposite + p2.b * u_ratio) * v_opposite + (p3.b * u_opposite + p4.b * u_ratio) * v_ratio));
+	}
+
+	Pixel* Sprite::GetData() { return pColData; }
+
+	int32_t Sprite::GetPitch() { return nPitch; }
+
+	SpriteView Sprite::GetView()
+	{
+		return SpriteView(pColData, width, height, nPitch);
+	}
+
+	SpriteView Sprite::GetView(int32_t x, int32_t y, int32_t w, int32_t h)
+	{
+		return GetView().Sub(x, y, w, h);
+	}
+
+	SpriteView::SpriteView(Pixel* pData, int32_t w, int32_t h, int32_t pitch)
+	{
+		this->pData = pData;
+		width = w;		height = h;
+		this->pitch = pitch > 0 ? pitch : w;
+	}
+
+	SpriteView SpriteView::Sub(int32_t x, int32_t y, int32_t w, int32_t h) const
+	{
+		int32_t x0 = std::max(x, 0), y0 = std::max(y, 0);
+		int32_t x1 = std::min(x + w, width), y1 = std::min(y + h, height);
+		if (x1 <= x0 || y1 <= y0) return SpriteView();
+		return SpriteView(At(x0, y0), x1 - x0, y1 - y0, pitch);
+	}
+
+	SpriteAtlas::SpriteAtlas(int32_t nPageWidth, int32_t nPageHeight, int32_t nPadding)
+	{
+		this->nPageWidth = std::max(nPageWidth, 1);
+		this->nPageHeight = std::max(nPageHeight, 1);
+		this->nPadding = std::max(nPadding, 0);
+	}
+
+	const uint32_t SpriteAtlas::INVALID;
+
+	SpriteAtlas::~SpriteAtlas()
+	{
+		Clear();
+	}
+
+	uint32_t SpriteAtlas::Add(const std::string& sName, Sprite* sprite)
+	{
+		if (sprite == nullptr) return INVALID;
+		return Add(sName, sprite->GetView());
+	}
+
+	uint32_t SpriteAtlas::Add(const std::string& sName, const SpriteView& image)
+	{
+		auto it = mapNames.find(sName);
+		if (it != mapNames.end()) return it->second;
+		if (image.pData == nullptr || image.width <= 0 || image.height <= 0) return INVALID;
+
+		sImage img;
+		img.sName = sName;
+		img.r.w = image.width;
+		img.r.h = image.height;
+		img.vPending.resize((size_t)image.width * image.height);
+		for (int32_t y = 0; y < image.height; y++)
+			std::copy(image.At(0, y), image.At(0, y) + image.width, img.vPending.begin() + (size_t)y * image.width);
+
+		uint32_t nHandle = (uint32_t)vImages.size();
+		vImages.push_back(std::move(img));
+		mapNames[sName] = nHandle;
+		vPending.push_back(nHandle);
+		return nHandle;
+	}
+
+	bool SpriteAtlas::jpr_Place(sPage& page, int32_t w, int32_t h, int32_t& x, int32_t& y)
+	{
+		// w and h include the padding, which may hang over the right and bottom edges
+		const std::vector<sSegment>& sky = page.vSkyline;
+		int32_t nLimitW = nPageWidth + nPadding, nLimitH = nPageHeight + nPadding;
+		int32_t nBest = -1, nBestY = 0;
+		for (size_t i = 0; i < sky.size(); i++)
+		{
+			if (sky[i].x + w > nLimitW) break;
+			// Resting on the highest segment beneath it
+			int32_t sy = 0;
+			for (size_t j = i; j < sky.size() && sky[j].x < sky[i].x + w; j++)
+				sy = std::max(sy, sky[j].y);
+			if (sy + h > nLimitH) continue;
+			if (nBest < 0 || sy < nBestY) { nBest = (int32_t)i; nBestY = sy; }
+		}
+		if (nBest < 0) return false;
+		x = sky[nBest].x;
+		y = nBestY;
+
+		// Raise the skyline across [x,x+w), what sticks out to the right keeps its height
+		std::vector<sSegment> v;
+		bool bAdded = false;
+		for (const auto& g : sky)
+		{
+			if (g.x + g.w <= x) { v.push_back(g); continue; }
+			if (!bAdded) { v.push_back({ x, y + h, w }); bAdded = true; }
+			if (g.x >= x + w) v.push_back(g);
+			else if (g.x + g.w > x + w) v.push_back({ x + w, g.y, g.x + g.w - (x + w) });
+		}
+
+		// Merge neighbours of the same height
+		page.vSkyline.clear();
+		for (const auto& g : v)
+		{
+			if (!page.vSkyline.empty() && page.vSkyline.back().y == g.y)
+				page.vSkyline.back().w += g.w;
+			else
+				page.vSkyline.push_back(g);
+		}
+		return true;
+	}
+
+	jpr::rcode SpriteAtlas::Build()
+	{
+		if (vPending.empty()) return jpr::OK;
+
+		// Tallest first, then widest, keeps the skyline flat
+		std::stable_sort(vPending.begin(), vPending.end(), [&](uint32_t a, uint32_t b)
+		{
+			const sRegion& ra = vImages[a].r;
+			const sRegion& rb = vImages[b].r;
+			return ra.h != rb.h ? ra.h > rb.h : ra.w > rb.w;
+		});
+
+		for (uint32_t i : vPending)
+		{
+			sRegion& r = vImages[i].r;
+			if (r.w > nPageWidth || r.h > nPageHeight)
+			{
+				sPage page;
+				page.bFull = true;
+				vPages.push_back(page);
+				r.nPage = (int32_t)vPages.size() - 1;
+				r.x = 0; r.y = 0;
+				continue;
+			}
+
+			r.nPage = -1;
+			for (size_t p = 0; p < vPages.size() && r.nPage < 0; p++)
+				if (!vPages[p].bFull && jpr_Place(vPages[p], r.w + nPadding, r.h + nPadding, r.x, r.y))
+					r.nPage = (int32_t)p;
+
+			if (r.nPage < 0)
+			{
+				sPage page;
+				page.vSkyline.push_back({ 0, 0, nPageWidth + nPadding });
+				vPages.push_back(page);
+				jpr_Place(vPages.back(), r.w + nPadding, r.h + nPadding, r.x, r.y);
+				r.nPage = (int32_t)vPages.size() - 1;
+			}
+		}
+
+		// Pages are only as big as what has been packed into them, grow the ones
+		// that have to, keeping what they already hold
+		std::vector<int32_t> vW(vPages.size(), 0), vH(vPages.size(), 0);
+		for (size_t p = 0; p < vPages.size(); p++)
+			if (vPages[p].pSprite)
+			{
+				vW[p] = vPages[p].pSprite->width;
+				vH[p] = vPages[p].pSprite->height;
+			}
+		for (uint32_t i : vPending)
+		{
+			const sRegion& r = vImages[i].r;
+			vW[r.nPage] = std::max(vW[r.nPage], r.x + r.w);
+			vH[r.nPage] = std::max(vH[r.nPage], r.y + r.h);
+		}
+		for (size_t p = 0; p < vPages.size(); p++)
+		{
+			Sprite* pOld = vPages[p].pSprite;
+			if (pOld && pOld->width == vW[p] && pOld->height == vH[p]) continue;
+
+			Sprite* pNew = new Sprite(vW[p], vH[p]);
+			std::fill(pNew->GetData(), pNew->GetData() + pNew->GetPitch() * pNew->height, jpr::BLANK);
+			if (pOld)
+			{
+				for (int32_t y = 0; y < pOld->height; y++)
+					std::copy(pOld->GetData() + y * pOld->GetPitch(), pOld->GetData() + y * pOld->GetPitch() + pOld->width,
+						pNew->GetData() + y * pNew->GetPitch());
+				delete pOld;
+			}
+			vPages[p].pSprite = pNew;
+		}
+
+		for (uint32_t i : vPending)
+		{
+			sImage& img = vImages[i];
+			SpriteView dst = GetView(i);
+			for (int32_t y = 0; y < img.r.h; y++)
+				std::copy(img.vPending.begin() + (size_t)y * img.r.w, img.vPending.begin() + (size_t)(y + 1) * img.r.w, dst.At(0, y));
+			std::vector<Pixel>().swap(img.vPending);
+		}
+		vPending.clear();
+		return jpr::OK;
+	}
+
+	void SpriteAtlas::Clear()
+	{
+		for (auto& p : vPages) delete p.pSprite;
+		vPages.clear();
+		vImages.clear();
+		mapNames.clear();
+		vPending.clear();
+	}
+
+	uint32_t SpriteAtlas::Find(const std::string& sName)
+	{
+		auto it = mapNames.find(sName);
+		return it != mapNames.end() ? it->second : INVALID;
+	}
+
+	uint32_t SpriteAtlas::Count()
+	{
+		return (uint32_t)vImages.size();
+	}
+
+	SpriteAtlas::sRegion SpriteAtlas::GetRegion(uint32_t nHandle)
+	{
+		if (nHandle >= vImages.size()) return sRegion();
+		return vImages[nHandle].r;
+	}
+
+	SpriteView SpriteAtlas::GetView(uint32_t nHandle)
+	{
+		sRegion r = GetRegion(nHandle);
+		Sprite* pPage = GetPage(r.nPage);
+		if (pPage == nullptr) return SpriteView();
+		return pPage->GetView(r.x, r.y, r.w, r.h);
+	}
+
+	int32_t SpriteAtlas::GetPageCount()
+	{
+		return (int32_t)vPages.size();
+	}
+
+	Sprite* SpriteAtlas::GetPage(int32_t nPage)
+	{
+		if (nPage < 0 || nPage >= (int32_t)vPages.size()) return nullptr;
+		return vPages[nPage].pSprite;
+	}
+
+	jpr::rcode SpriteAtlas::SaveToPack(jpr::ResourcePack* pack, std::string sName)
+	{
+		if (pack == nullptr) return jpr::FAIL;
+		Build();
+
+		std::ostringstream oss(std::ios::binary);
+		auto Write = [&](int32_t n) { oss.write((char*)&n, sizeof(int32_t)); };
+		Write(nPageWidth); Write(nPageHeight); Write(nPadding);
+		Write((int32_t)vPages.size());
+		Write((int32_t)vImages.size());
+		for (const auto& img : vImages)
+		{
+			Write((int32_t)img.sName.size());
+			oss.write(img.sName.data(), img.sName.size());
+			Write(img.r.nPage); Write(img.r.x); Write(img.r.y); Write(img.r.w); Write(img.r.h);
+		}
+		std::string sData = oss.str();
+		if (pack->AddToPack(sName, (const uint8_t*)sData.data(), (uint32_t)sData.size()) != jpr::OK)
+			return jpr::FAIL;
+
+		for (size_t p = 0; p < vPages.size(); p++)
+			if (vPages[p].pSprite->SaveToPGESprFile(sName + "#" + std::to_string(p), pack) != jpr::OK)
+				return jpr::FAIL;
+		return jpr::OK;
+	}
+
+	jpr::rcode SpriteAtlas::LoadFromPack(jpr::ResourcePack* pack, std::string sName)
+	{
+		if (pack == nullptr) return jpr::FAIL;
+		Clear();
+
+		auto streamBuffer = pack->GetStreamBuffer(sName);
+		std::istream is(&streamBuffer);
+		auto Read = [&]() { int32_t n = 0; is.read((char*)&n, sizeof(int32_t)); return n; };
+		int32_t nPageW = Read(), nPageH = Read(), nPad = Read();
+		int32_t nPages = Read(), nImages = Read();
+		if (!is || nPageW <= 0 || nPageH <= 0 || nPad < 0 || nPages < 0 || nImages < 0) return jpr::FAIL;
+		nPageWidth = nPageW; nPageHeight = nPageH; nPadding = nPad;
+
+		for (int32_t i = 0; i < nImages; i++)
+		{
+			int32_t nLength = Read();
+			// A name can't be longer than what is left of the entry, so a corrupt
+			// length is rejected before anything is allocated for it
+			if (!is || nLength < 0 || nLength > streamBuffer.in_avail()) { Clear(); return jpr::FAIL; }
+			sImage img;
+			img.sName.resize(nLength);
+			is.read(&img.sName[0], nLength);
+			img.r.nPage = Read(); img.r.x = Read(); img.r.y = Read(); img.r.w = Read(); img.r.h = Read();
+			if (!is || img.r.nPage < 0 || img.r.nPage >= nPages) { Clear(); return jpr::FAIL; }
+			mapNames[img.sName] = (uint32_t)vImages.size();
+			vImages.push_back(std::move(img));
+		}
+
+		for (int32_t p = 0; p < nPages; p++)
+		{
+			sPage page;
+			page.pSprite = new Sprite();
+			vPages.push_back(page);
+			if (page.pSprite->LoadFromPGESprFile(sName + "#" + std::to_string(p), pack) != jpr::OK)
+			{
+				Clear();
+				return jpr::FAIL;
+			}
+			// Where the free space was is not stored, later images go below what is there
+			vPages.back().bFull = page.pSprite->width > nPageWidth || page.pSprite->height > nPageHeight;
+			vPages.back().vSkyline.push_back({ 0, page.pSprite->height + nPadding, nPageWidth + nPadding });
+		}
+		return jpr::OK;
+	}
+
+	FrameStats::FrameStats(uint32_t nHistory)
+	{
+		this->nHistory = std::max(nHistory, 1u);
+		vHistory.resize(this->nHistory * PHASE_COUNT, 0.0f);
+	}
+
+	FrameStats::~FrameStats()
+	{
+		CloseCSV();
+	}
+
+	uint32_t FrameStats::Count()
+	{
+		return nCount;
+	}
+
+	float FrameStats::Get(Phase p, uint32_t nAgo)
+	{
+		if (nAgo >= nCount) return 0.0f;
+		uint32_t i = (nNext + nHistory - 1 - nAgo) % nHistory;
+		return vHistory[i * PHASE_COUNT + p];
+	}
+
+	float FrameStats::Percentile(Phase p, float fPercent)
+	{
+		if (nCount == 0) return 0.0f;
+
+		std::vector<float> v(nCount);
+		for (uint32_t i = 0; i < nCount; i++)
+			v[i] = vHistory[i * PHASE_COUNT + p];
+
+		// Nearest rank
+		float fRank = std::min(std::max(fPercent, 0.0f), 100.0f) / 100.0f * (float)(nCount - 1);
+		auto it = v.begin() + (size_t)(fRank + 0.5f);
+		std::nth_element(v.begin(), it, v.end());
+		return *it;
+	}
+
+	float FrameStats::Average(Phase p)
+	{
+		if (nCount == 0) return 0.0f;
+		double fSum = 0.0;
+		for (uint32_t i = 0; i < nCount; i++)
+			fSum += vHistory[i * PHASE_COUNT + p];
+		return (float)(fSum / nCount);
+	}
+
+	float FrameStats::Max(Phase p)
+	{
+		float fMax = 0.0f;
+		for (uint32_t i = 0; i < nCount; i++)
+			fMax = std::max(fMax, vHistory[i * PHASE_COUNT + p]);
+		return fMax;
+	}
+
+	jpr::rcode FrameStats::OpenCSV(std::string sFile)
+	{
+		CloseCSV();
+		ofsCSV.open(sFile);
+		if (!ofsCSV.is_open()) return jpr::FAIL;
+
+		ofsCSV << "frame";
+		for (int p = 0; p < PHASE_COUNT; p++)
+			ofsCSV << "," << PhaseName((Phase)p) << "_ms";
+		ofsCSV << "\n";
+		return jpr::OK;
+	}
+
+	void FrameStats::CloseCSV()
+	{
+		if (ofsCSV.is_open()) ofsCSV.close();
+	}
+
+	const char* FrameStats::PhaseName(Phase p)
+	{
+		static const char* sNames[PHASE_COUNT] = { "events", "input", "update", "upload", "present", "frame" };
+		return sNames[p];
+	}
+
+	void FrameStats::Record(const float* fPhaseTimes)
+	{
+		std::copy(fPhaseTimes, fPhaseTimes + PHASE_COUNT, vHistory.begin() + nNext * PHASE_COUNT);
+		nNext = (nNext + 1) % nHistory;
+		nCount = std::min(nCount + 1, nHistory);
+
+		if (ofsCSV.is_open())
+		{
+			ofsCSV << nFrame;
+			for (int p = 0; p < PHASE_COUNT; p++)
+				ofsCSV << "," << fPhaseTimes[p];
+			ofsCSV << "\n";
+		}
+		nFrame++;
+	}
+
+	ResourcePack::ResourcePack()
+	{
+
+	}
+
+	ResourcePack::~ResourcePack()
+	{
+		ClearPack();
+	}
+
+	jpr::rcode ResourcePack::AddToPack(std::string sFile)
+	{
+		std::ifstream ifs(sFile, std::ifstream::binary);
+		if (!ifs.is_open()) return jpr::FAIL;
+
+		// Get File Size
+		std::streampos p = 0;
+		p = ifs.tellg();
+		ifs.seekg(0, std::ios::end);
+		p = ifs.tellg() - p;
+		ifs.seekg(0, std::ios::beg);
+
+		// Create entry
+		sEntry e;
+		e.data = nullptr;
+		e.nFileSize = (uint32_t)p;
+
+		// Read file into memory
+		e.data = new uint8_t[(uint32_t)e.nFileSize];
+		ifs.read((char*)e.data, e.nFileSize);
+		ifs.close();
+		e._config();
+
+		// Add To Map, replacing any earlier entry
+		if (mapFiles.count(sFile)) delete[] mapFiles[sFile].data;
+		mapFiles[sFile] = e;
+		return jpr::OK;
+	}
+
+	jpr::rcode ResourcePack::AddToPack(std::string sFile, const uint8_t* pData, uint32_t nSize)
+	{
+		sEntry e;
+		e.nFileSize = nSize;
+		e.data = new uint8_t[nSize];
+		std::copy(pData, pData + nSize, e.data);
+		e._config();
+
+		if (mapFiles.count(sFile)) delete[] mapFiles[sFile].data;
+		mapFiles[sFile] = e;
+		return jpr::OK;
+	}
+
+	jpr::rcode ResourcePack::SavePack(std::string sFile)
+	{
+		std::ofstream ofs(sFile, std::ofstream::binary);
+		if (!ofs.is_open()) return jpr::FAIL;
+
+		// 1) Write Map, with the 32 bit sizes LoadPack() reads
+		uint32_t nMapSize = (uint32_t)mapFiles.size();
+		ofs.write((char*)&nMapSize, sizeof(uint32_t));
+		for (auto &e : mapFiles)
+		{
+			uint32_t nPathSize = (uint32_t)e.first.size();
+			ofs.write((char*)&nPathSize, sizeof(uint32_t));
+			ofs.write(e.first.c_str(), nPathSize);
+			ofs.write((char*)&e.second.nID, sizeof(uint32_t));
+			ofs.write((char*)&e.second.nFileSize, sizeof(uint32_t));
+			ofs.write((char*)&e.second.nFileOffset, sizeof(uint32_t));
+		}
+
+		// 2) Write Data
+		std::streampos offset = ofs.tellp();
+		for (auto &e : mapFiles)
+		{
+			e.second.nFileOffset = (uint32_t)offset;
+			ofs.write((char*)e.second.data, e.second.nFileSize);
+			offset += e.second.nFileSize;
+		}
+
+		// 3) Rewrite Map (it has been updated with offsets now)
+		ofs.seekp(std::ios::beg);
+		ofs.write((char*)&nMapSize, sizeof(uint32_t));
+		for (auto &e : mapFiles)
+		{
+			uint32_t nPathSize = (uint32_t)e.first.size();
+			ofs.write((char*)&nPathSize, sizeof(uint32_t));
+			ofs.write(e.first.c_str(), nPathSize);
+			ofs.write((char*)&e.second.nID, sizeof(uint32_t));
+			ofs.write((char*)&e.second.nFileSize, sizeof(uint32_t));
+			ofs.write((char*)&e.second.nFileOffset, sizeof(uint32_t));
+		}
+		ofs.close();
+
+		return jpr::OK;
+	}
+
+	jpr::rcode ResourcePack::LoadPack(std::string sFile)
+	{
+		std::ifstream ifs(sFile, std::ifstream::binary);
+		if (!ifs.is_open()) return jpr::FAIL;
+
+		// 1) Read Map
+		uint32_t nMapEntries;
+		ifs.read((char*)&nMapEntries, sizeof(uint32_t));
+		for (uint32_t i = 0; i < nMapEntries; i++)
+		{
+			uint32_t nFilePathSize = 0;
+			ifs.read((char*)&nFilePathSize, sizeof(uint32_t));
+
+			std::string sFileName(nFilePathSize, ' ');
+			for (uint32_t j = 0; j < nFilePathSize; j++)
+				sFileName[j] = ifs.get();
+
+			sEntry e;
+			e.data = nullptr;
+			ifs.read((char*)&e.nID, sizeof(uint32_t));
+			ifs.read((char*)&e.nFileSize, sizeof(uint32_t));
+			ifs.read((char*)&e.nFileOffset, sizeof(uint32_t));
+			mapFiles[sFileName] = e;
+		}
+
+		// 2) Read Data
+		for (auto &e : mapFiles)
+		{
+			e.second.data = new uint8_t[(uint32_t)e.second.nFileSize];
+			ifs.seekg(e.second.nFileOffset);
+			ifs.read((char*)e.second.data, e.second.nFileSize);
+			e.second._config();
+		}
+
+		ifs.close();
+		return jpr::OK;
+	}
+
+	jpr::ResourcePack::sEntry ResourcePack::GetStreamBuffer(std::string sFile)
+	{
+		// Looking up never adds an entry, so several threads can read one pack
+		auto it = mapFiles.find(sFile);
+		return it != mapFiles.end() ? it->second : sEntry();
+	}
+
+	jpr::rcode ResourcePack::ClearPack()
+	{
+		for (auto &e : mapFiles)
+		{
+			if (e.second.data != nullptr)
+				delete[] e.second.data;
+		}
+
+		mapFiles.clear();
+		return jpr::OK;
+	}
+
+	RetroGameEngine::RetroGameEngine()
+	{
+		sAppName = "Undefined";
+		jpr::PGEX::pge = this;
+	}
+
+	RetroGameEngine::~RetroGameEngine()
+	{
+		jpr_StopRenderWorkers();
+		ClearTextCache();
+	}
+
+	jpr::rcode RetroGameEngine::Construct(uint32_t screen_w, uint32_t screen_h, uint32_t pixel_w, uint32_t pixel_h, bool full_screen, bool vsync)
+	{
+		nScreenWidth = screen_w;
+		nScreenHeight = screen_h;
+		nPixelWidth = pixel_w;
+		nPixelHeight = pixel_h;
+		bFullScreen = full_screen;
+		bEnableVSYNC = vsync;
+
+		fPixelX = 2.0f / (float)(nScreenWidth);
+		fPixelY = 2.0f / (float)(nScreenHeight);
+
+		if (nPixelWidth == 0 || nPixelHeight == 0 || nScreenWidth == 0 || nScreenHeight == 0)
+			return jpr::FAIL;
+
+#if defined(_WIN32) && defined(UNICODE) && !defined(__MINGW32__)
+		wsAppName = ConvertS2W(sAppName);
+#endif
+		// Load the default font sheet
+		jpr_ConstructFontSheet();
+
+		// Create a sprite that represents the primary drawing target
+		pDefaultDrawTarget = new Sprite(nScreenWidth, nScreenHeight, SpriteAllocator::Heap());
+		nScreenPitch = pDefaultDrawTarget->GetPitch();
+		SetDrawTarget(nullptr);
+		return jpr::OK;
+	}
+
+
+	void RetroGameEngine::SetScreenSize(int w, int h)
+	{
+		// The frame buffers are shared with the present thread
+		if (bThreadedPresent && bAtomActive) return;
+
+		if (bDeferred) jpr_FlushDeferred();
+		delete pDefaultDrawTarget;
+		nScreenWidth = w;
+		nScreenHeight = h;
+		pDefaultDrawTarget = new Sprite(nScreenWidth, nScreenHeight, SpriteAllocator::Heap());
+		nScreenPitch = pDefaultDrawTarget->GetPitch();
+		SetDrawTarget(nullptr);
+		MarkDirty(0, 0, nScreenWidth, nScreenHeight);
+
+		// No window to present to
+		if (bHeadless) return;
+
+		glClear(GL_COLOR_BUFFER_BIT);
+
+#if defined(_WIN32)
+		SwapBuffers(glDeviceContext);
+#endif
+
+#if defined(__linux__)
+		glXSwapBuffers(jpr_Display, jpr_Window);
+#endif
+
+		glClear(GL_COLOR_BUFFER_BIT);
+		jpr_UpdateViewport();
+	}
+
+	jpr::rcode RetroGameEngine::Start()
+	{
+		// Construct the window
+		if (!jpr_WindowCreate())
+			return jpr::FAIL;
+
+		// The screen sprite becomes one of three rotating frame buffers
+		if (bThreadedPresent)
+		{
+			pFrameBuffers[0] = pDefaultDrawTarget;
+			pFrameBuffers[1] = new Sprite(nScreenWidth, nScreenHeight, SpriteAllocator::Heap());
+			pFrameBuffers[2] = new Sprite(nScreenWidth, nScreenHeight, SpriteAllocator::Heap());
+			nDrawBuffer = 0;
+			nPresentBuffer = 1;
+			nReadyBuffer = 2;
+			bDirtyTracking = false;
+		}
+
+		// Start the thread
+		bAtomActive = true;
+		std::thread t = std::thread(&RetroGameEngine::EngineThread, this);
+
+#if defined(_WIN32)
+		// Handle Windows Message Loop
+		MSG msg;
+		while (GetMessage(&msg, NULL, 0, 0) > 0)
+		{
+			TranslateMessage(&msg);
+			DispatchMessage(&msg);
+		}
+#endif
+
+		// Wait for thread to be exited
+		t.join();
+
+		// Keep whichever frame buffer ended up as the screen, free the other two
+		if (bThreadedPresent)
+		{
+			for (int i = 0; i < 3; i++)
+			{
+				if (pFrameBuffers[i] != pDefaultDrawTarget) delete pFrameBuffers[i];
+				pFrameBuffers[i] = nullptr;
+			}
+			pDrawTarget = pDefaultDrawTarget;
+		}
+		return jpr::OK;
+	}
+
+	jpr::rcode RetroGameEngine::StartHeadless(uint32_t nFrames, float fElapsedTime)
+	{
+		if (pDefaultDrawTarget == nullptr)
+			return jpr::FAIL;
+
+		// No window, no OpenGL - the engine runs on the calling thread
+		bHeadless = true;
+		bAtomActive = true;
+		HeadlessThread(nFrames, fElapsedTime);
+		return jpr::OK;
+	}
+
+	void RetroGameEngine::SetDrawTarget(Sprite *target)
+	{
+		// Deferred commands are only ever for one target
+		if (bDeferred && (target ? target : pDefaultDrawTarget) != pDrawTarget)
+			jpr_FlushDeferred();
+
+		if (target)
+			pDrawTarget = target;
+		else
+			pDrawTarget = pDefaultDrawTarget;
+	}
+
+	void RetroGameEngine::SetDrawTarget(const SpriteView& target)
+	{
+		// The wrapper is reused, so a new view always ends the deferred commands
+		if (bDeferred) jpr_FlushDeferred();
+
+		sprViewTarget.jpr_Wrap(target);
+		pDrawTarget = &sprViewTarget;
+
+		// Find out whether the view looks into the screen, so it can be marked dirty
+		bViewOnScreen = false;
+		Sprite* pScreen = pDefaultDrawTarget;
+		if (pScreen && pScreen->GetData() && target.pData && target.pitch == pScreen->GetPitch())
+		{
+			uintptr_t nBase = (uintptr_t)pScreen->GetData(), nView = (uintptr_t)target.pData;
+			if (nView >= nBase && nView < nBase + (uintptr_t)pScreen->GetPitch() * pScreen->height * sizeof(Pixel))
+			{
+				int32_t nOffset = (int32_t)((nView - nBase) / sizeof(Pixel));
+				nViewTargetX = nOffset % target.pitch;
+				nViewTargetY = nOffset / target.pitch;
+				bViewOnScreen = nViewTargetX + target.width <= pScreen->width && nViewTargetY + target.height <= pScreen->height;
+			}
+		}
+	}
+
+	Sprite* RetroGameEngine::GetDrawTarget()
+	{
+		return pDrawTarget;
+	}
+
+	bool RetroGameEngine::IsHeadless()
+	{
+		return bHeadless;
+	}
+
+	int32_t RetroGameEngine::GetDrawTargetWidth()
+	{
+		if (pDrawTarget)
+			return pDrawTarget->width;
+		else
+			return 0;
+	}
+
+	int32_t RetroGameEngine::GetDrawTargetHeight()
+	{
+		if (pDrawTarget)
+			return pDrawTarget->height;
+		else
+			return 0;
+	}
+
+	bool RetroGameEngine::IsFocused()
+	{
+		return bHasInputFocus;
+	}
+
+	HWButton RetroGameEngine::GetKey(Key k)
+	{
+		return pKeyboardState[k];
+	}
+
+	HWButton RetroGameEngine::GetMouse(uint32_t b)
+	{
+		return pMouseState[b];
+	}
+
+	int32_t RetroGameEngine::GetMouseX()
+	{
+		return nMousePosX;
+	}
+
+	int32_t RetroGameEngine::GetMouseY()
+	{
+		return nMousePosY;
+	}
+
+	int32_t RetroGameEngine::GetMouseWheel()
+	{
+		return nMouseWheelDelta;
+	}
+
+	int32_t RetroGameEngine::ScreenWidth()
+	{
+		return nScreenWidth;
+	}
+
+	int32_t RetroGameEngine::ScreenHeight()
+	{
+		return nScreenHeight;
+	}
+
+#ifdef JPR_DBG_OVERDRAW
+	// Charges the pixels written until the end of the scope to one draw routine,
+	// unless a routine further up the call stack has already claimed them
+	struct jpr_DbgPrimitiveScope
+	{
+		RetroGameEngine* pge;
+		RetroGameEngine::DbgPrimitive nPrev;
+
+		jpr_DbgPrimitiveScope(RetroGameEngine* pge, RetroGameEngine::DbgPrimitive p) : pge(pge), nPrev(pge->nDbgPrimitive)
+		{
+			if (nPrev == RetroGameEngine::DBG_OTHER) pge->nDbgPrimitive = p;
+		}
+
+		~jpr_DbgPrimitiveScope()
+		{
+			pge->nDbgPrimitive = nPrev;
+		}
+	};
+#define JPR_DBG_PRIMITIVE(p) jpr_DbgPrimitiveScope jpr_dbgScope(this, RetroGameEngine::p)
+#else
+#define JPR_DBG_PRIMITIVE(p)
+#endif
+
+	// Pixel writers, one per Pixel::Mode. The draw routines select one of these
+	// once per call (see jpr_WithPixelWriter()), so their inner loops are
+	// compiled for a single mode and never re-test nPixelMode per pixel
+	template<class Derived>
+	struct PixelWriter
+	{
+		Pixel*	pData = nullptr;
+		int32_t	nPitch = 0;
+		int32_t	nWidth = 0;
+		int32_t	nHeight = 0;
+		// Only [nClipX0,nClipX1) x [nClipY0,nClipY1) of the draw target is written
+		int32_t	nClipX0 = 0;
+		int32_t	nClipY0 = 0;
+		int32_t	nClipX1 = 0;
+		int32_t	nClipY1 = 0;
+#ifdef JPR_DBG_OVERDRAW
+		uint16_t* pOverdraw = nullptr;
+		uint64_t* pPrimitivePixels = nullptr;
+
+		inline void CountWrites(int32_t x, int32_t y, int32_t n) const
+		{
+			jpr::Sprite::nOverdrawCount += n;
+			*pPrimitivePixels += n;
+			uint16_t* c = pOverdraw + y * nWidth + x;
+			for (int32_t i = 0; i < n; i++)
+				c[i] += (c[i] != 0xFFFF);
+		}
+#endif
+
+		inline Pixel* At(int32_t x, int32_t y) const
+		{
+			return pData + y * nPitch + x;
+		}
+
+		// Writes a single pixel, if it lies within the clip rectangle
+		inline bool Plot(int32_t x, int32_t y, Pixel p) const
+		{
+			if (x < nClipX0 || x >= nClipX1 || y < nClipY0 || y >= nClipY1)
+				return false;
+#ifdef JPR_DBG_OVERDRAW
+			CountWrites(x, y, 1);
+#endif
+			return static_cast<const Derived*>(this)->Put(*At(x, y), x, y, p);
+		}
+
+		// Writes the horizontal run sx..ex (inclusive) of row y, clipped to the clip rectangle
+		inline void HSpan(int32_t sx, int32_t ex, int32_t y, Pixel p) const
+		{
+			if (y < nClipY0 || y >= nClipY1) return;
+			if (sx < nClipX0) sx = nClipX0;
+			if (ex >= nClipX1) ex = nClipX1 - 1;
+			if (ex < sx) return;
+			Fill(sx, y, ex - sx + 1, p);
+		}
+
+		// Writes n pixels of colour p from (x,y), the span must already be clipped
+		inline void Fill(int32_t x, int32_t y, int32_t n, Pixel p) const
+		{
+#ifdef JPR_DBG_OVERDRAW
+			CountWrites(x, y, n);
+#endif
+			static_cast<const Derived*>(this)->FillSpan(At(x, y), x, y, n, p);
+		}
+
+		// Writes the n pixels at s from (x,y), the span must already be clipped
+		inline void Copy(int32_t x, int32_t y, const Pixel* s, int32_t n) const
+		{
+#ifdef JPR_DBG_OVERDRAW
+			CountWrites(x, y, n);
+#endif
+			static_cast<const Derived*>(this)->CopySpan(At(x, y), x, y, s, n);
+		}
+
+		// Generic span fill and copy, writers override these where they can do better
+		inline void FillSpan(Pixel* d, int32_t x, int32_t y, int32_t n, Pixel p) const
+		{
+			for (int32_t i = 0; i < n; i++)
+				static_cast<const Derived*>(this)->Put(d[i], x + i, y, p);
+		}
+
+		inline void CopySpan(Pixel* d, int32_t x, int32_t y, const Pixel* s, int32_t n) const
+		{
+			for (int32_t i = 0; i < n; i++)
+				static_cast<const Derived*>(this)->Put(d[i], x + i, y, s[i]);
+		}
+	};
+
+	struct PixelWriterNormal : public PixelWriter<PixelWriterNormal>
+	{
+		inline bool Put(Pixel& d, int32_t, int32_t, Pixel p) const
+		{
+			d = p;
+			return true;
+		}
+
+		inline void FillSpan(Pixel* d, int32_t, int32_t, int32_t n, Pixel p) const
+		{
+			std::fill(d, d + n, p);
+		}
+
+		inline void CopySpan(Pixel* d, int32_t, int32_t, const Pixel* s, int32_t n) const
+		{
+			std::copy(s, s + n, d);
+		}
+	};
+
+	struct PixelWriterMask : public PixelWriter<PixelWriterMask>
+	{
+		inline bool Put(Pixel& d, int32_t, int32_t, Pixel p) const
+		{
+			if (p.a != 255) return false;
+			d = p;
+			return true;
+		}
+
+		inline void FillSpan(Pixel* d, int32_t, int32_t, int32_t n, Pixel p) const
+		{
+			if (p.a == 255) std::fill(d, d + n, p);
+		}
+
+		inline void CopySpan(Pixel* d, int32_t, int32_t, const Pixel* s, int32_t n) const
+		{
+			jpr_MaskCopySpan(d, s, n);
+		}
+	};
+
+	struct PixelWriterAlpha : public PixelWriter<PixelWriterAlpha>
+	{
+		float		fBlend = 1.0f;
+		uint32_t	nBlend = 255;
+
+		inline bool Put(Pixel& d, int32_t, int32_t, Pixel p) const
+		{
+			d = jpr_BlendPixel(p, d, nBlend);
+			return true;
+		}
+
+		inline void FillSpan(Pixel* d, int32_t, int32_t, int32_t n, Pixel p) const
+		{
+			BlendSpan(d, p, n, fBlend);
+		}
+
+		inline void CopySpan(Pixel* d, int32_t, int32_t, const Pixel* s, int32_t n) const
+		{
+			BlendSpan(d, s, n, fBlend);
+		}
+	};
+
+	struct PixelWriterCustom : public PixelWriter<PixelWriterCustom>
+	{
+		const std::function<jpr::Pixel(const int x, const int y, const jpr::Pixel&, const jpr::Pixel&)>* pFunc = nullptr;
+
+		inline bool Put(Pixel& d, int32_t x, int32_t y, Pixel p) const
+		{
+			d = (*pFunc)(x, y, p, d);
+			return true;
+		}
+	};
+
+	// Rasterisers for the draw routines, shared by immediate and deferred drawing.
+	// They only write through the pixel writer, so they are confined to its clip rectangle
+	template<class W>
+	void jpr_RasterLine(const W& w, int32_t x1, int32_t y1, int32_t x2, int32_t y2, Pixel p, uint32_t pattern)
+	{
+		int x, y, dx, dy, dx1, dy1, px, py;
+		dx = x2 - x1; dy = y2 - y1;
+
+		auto rol = [&](void)
+		{
+			pattern = (pattern << 1) | (pattern >> 31);
+			return pattern & 1;
+		};
+
+		// Advances the pattern as if n pixels had been stepped over
+		auto skip = [&](int32_t n)
+		{
+			n &= 31;
+			if (n) pattern = (pattern << n) | (pattern >> (32 - n));
+		};
+
+		// straight lines, only the part inside the clip rectangle is walked
+		// Line is vertical
+		if (dx == 0)
+		{
+			if (x1 < w.nClipX0 || x1 >= w.nClipX1) return;
+			if (y2 < y1) std::swap(y1, y2);
+			if (y1 < w.nClipY0) { skip(w.nClipY0 - y1); y1 = w.nClipY0; }
+			y2 = std::min(y2, w.nClipY1 - 1);
+			for (y = y1; y <= y2; y++)
+				if (rol()) w.Plot(x1, y, p);
+			return;
+		}
+
+		// Line is horizontal
+		if (dy == 0)
+		{
+			if (y1 < w.nClipY0 || y1 >= w.nClipY1) return;
+			if (x2 < x1) std::swap(x1, x2);
+			if (x1 < w.nClipX0) { skip(w.nClipX0 - x1); x1 = w.nClipX0; }
+			x2 = std::min(x2, w.nClipX1 - 1);
+			for (x = x1; x <= x2; x++)
+				if (rol()) w.Plot(x, y1, p);
+			return;
+		}
+
+		// Line is Funk-aye. Bresenham's position and error term after k steps have
+		// a closed form, so the walk is clipped to the steps that land inside the
+		// clip rectangle and starts there, with the pattern skipped to match
+		auto ceildiv = [](int64_t a, int64_t b) { return a >= 0 ? (a + b - 1) / b : -((-a) / b); };
+		dx1 = abs(dx); dy1 = abs(dy);
+		int32_t sd = ((dx<0 && dy<0) || (dx>0 && dy>0)) ? 1 : -1;
+		if (dy1 <= dx1)
+		{
+			if (dx >= 0)
+			{
+				x = x1; y = y1;
+			}
+			else
+			{
+				x = x2; y = y2;
+			}
+
+			// Steps inside the clip rectangle horizontally, then vertically where
+			// y moves floor((2*dy1*k + dx1) / (2*dx1)) rows after k steps
+			int64_t k0 = std::max<int64_t>(0, (int64_t)w.nClipX0 - x);
+			int64_t k1 = std::min<int64_t>(dx1, (int64_t)w.nClipX1 - 1 - x);
+			int64_t a = sd > 0 ? (int64_t)w.nClipY0 - y : (int64_t)y - (w.nClipY1 - 1);
+			int64_t b = sd > 0 ? (int64_t)w.nClipY1 - 1 - y : (int64_t)y - w.nClipY0;
+			if (b < 0) return;
+			k0 = std::max(k0, ceildiv(2 * (int64_t)dx1 * std::max<int64_t>(a, 0) - dx1, 2 * (int64_t)dy1));
+			k1 = std::min(k1, ceildiv(2 * (int64_t)dx1 * (b + 1) - dx1, 2 * (int64_t)dy1) - 1);
+			if (k1 < k0) return;
+
+			int64_t n = (2 * (int64_t)dy1 * k0 + dx1) / (2 * (int64_t)dx1);
+			x += (int32_t)k0; y += sd * (int32_t)n;
+			px = (int32_t)(2 * (int64_t)dy1 * (k0 + 1) - dx1 - 2 * (int64_t)dx1 * n);
+			skip((int32_t)(k0 & 31));
+
+			for (int64_t k = k0; k <= k1; k++)
+			{
+				if (rol()) w.Plot(x, y, p);
+				x = x + 1;
+				if (px<0)
+					px = px + 2 * dy1;
+				else
+				{
+					y = y + sd;
+					px = px + 2 * (dy1 - dx1);
+				}
+			}
+		}
+		else
+		{
+			if (dy >= 0)
+			{
+				x = x1; y = y1;
+			}
+			else
+			{
+				x = x2; y = y2;
+			}
+
+			// As above with the axes swapped, x moves floor((2*dx1*k + dy1 - 1) / (2*dy1))
+			// columns after k steps
+			int64_t k0 = std::max<int64_t>(0, (int64_t)w.nClipY0 - y);
+			int64_t k1 = std::min<int64_t>(dy1, (int64_t)w.nClipY1 - 1 - y);
+			int64_t a = sd > 0 ? (int64_t)w.nClipX0 - x : (int64_t)x - (w.nClipX1 - 1);
+			int64_t b = sd > 0 ? (int64_t)w.nClipX1 - 1 - x : (int64_t)x - w.nClipX0;
+			if (b < 0) return;
+			k0 = std::max(k0, ceildiv(2 * (int64_t)dy1 * std::max<int64_t>(a, 0) - dy1 + 1, 2 * (int64_t)dx1));
+			k1 = std::min(k1, ceildiv(2 * (int64_t)dy1 * (b + 1) - dy1 + 1, 2 * (int64_t)dx1) - 1);
+			if (k1 < k0) return;
+
+			int64_t n = (2 * (int64_t)dx1 * k0 + dy1 - 1) / (2 * (int64_t)dy1);
+			y += (int32_t)k0; x += sd * (int32_t)n;
+			py = (int32_t)(2 * (int64_t)dx1 * (k0 + 1) - dy1 - 2 * (int64_t)dy1 * n);
+			skip((int32_t)(k0 & 31));
+
+			for (int64_t k = k0; k <= k1; k++)
+			{
+				if (rol()) w.Plot(x, y, p);
+				y = y + 1;
+				if (py <= 0)
+					py = py + 2 * dx1;
+				else
+				{
+					x = x + sd;
+					py = py + 2 * (dx1 - dy1);
+				}
+			}
+		}
+	}
+
+	template<class W>
+	void jpr_RasterCircle(const W& w, int32_t x, int32_t y, int32_t radius, Pixel p, uint8_t mask)
+	{
+		// Nothing to do if the circle misses the clip rectangle
+		if (x + radius < w.nClipX0 || x - radius >= w.nClipX1 || y + radius < w.nClipY0 || y - radius >= w.nClipY1)
+			return;
+
+		int x0 = 0;
+		int y0 = radius;
+		int d = 3 - 2 * radius;
+		auto RowIn = [&](int32_t r) { return r >= w.nClipY0 && r < w.nClipY1; };
+
+		// only formulate 1/8 of circle, octants are only plotted on visible rows
+		while (y0 >= x0)
+		{
+			if (RowIn(y - y0))
+			{
+				if (mask & 0x01) w.Plot(x + x0, y - y0, p);
+				if (mask & 0x80) w.Plot(x - x0, y - y0, p);
+			}
+			if (RowIn(y - x0))
+			{
+				if (mask & 0x02) w.Plot(x + y0, y - x0, p);
+				if (mask & 0x40) w.Plot(x - y0, y - x0, p);
+			}
+			if (RowIn(y + x0))
+			{
+				if (mask & 0x04) w.Plot(x + y0, y + x0, p);
+				if (mask & 0x20) w.Plot(x - y0, y + x0, p);
+			}
+			if (RowIn(y + y0))
+			{
+				if (mask & 0x08) w.Plot(x + x0, y + y0, p);
+				if (mask & 0x10) w.Plot(x - x0, y + y0, p);
+			}
+			if (d < 0) d += 4 * x0++ + 6;
+			else d += 4 * (x0++ - y0--) + 10;
+		}
+	}
+
+	template<class W>
+	void jpr_RasterFillCircle(const W& w, int32_t x, int32_t y, int32_t radius, Pixel p)
+	{
+		if (radius < 0) return;
+		if (x + radius < w.nClipX0 || x - radius >= w.nClipX1 || y + radius < w.nClipY0 || y - radius >= w.nClipY1)
+			return;
+
+		// Writes the rows dy above and below the centre, each exactly once
+		auto Rows = [&](int32_t dy, int32_t hw)
+		{
+			w.HSpan(x - hw, x + hw, y - dy, p);
+			if (dy) w.HSpan(x - hw, x + hw, y + dy, p);
+		};
+
+		// Taken from wikipedia, modified to emit scan-lines. Rows x0 away from the
+		// centre are widest at y0 and appear once per step. Rows y0 away repeat
+		// while y0 holds, so they are written when it changes, at their widest
+		int x0 = 0;
+		int y0 = radius;
+		int d = 3 - 2 * radius;
+
+		while (y0 >= x0)
+		{
+			Rows(x0, y0);
+			if (d < 0) d += 4 * x0++ + 6;
+			else
+			{
+				if (y0 > x0) Rows(y0, x0);
+				d += 4 * (x0++ - y0--) + 10;
+			}
+		}
+	}
+
+	// Fills [x1,x2) x [y1,y2)
+	template<class W>
+	void jpr_RasterFillRect(const W& w, int32_t x1, int32_t y1, int32_t x2, int32_t y2, Pixel p)
+	{
+		// Clip once against the writer
+		x1 = std::max(x1, w.nClipX0); y1 = std::max(y1, w.nClipY0);
+		x2 = std::min(x2, w.nClipX1); y2 = std::min(y2, w.nClipY1);
+		if (x2 <= x1) return;
+		for (int32_t j = y1; j < y2; j++)
+			w.Fill(x1, j, x2 - x1, p);
+	}
+
+	// Half-space triangle coverage. Pixel (x,y) is inside when all three edge
+	// functions are positive there, or zero on a top or left edge, so triangles
+	// sharing an edge never both cover it. Each edge bounds x linearly on a row, so
+	// the row's inside pixels are solved for directly and passed to fSpan(x, y, n)
+	template<class W, class F>
+	void jpr_RasterTriangleSpans(const W& w, int32_t x1, int32_t y1, int32_t x2, int32_t y2, int32_t x3, int32_t y3, F&& fSpan)
+	{
+		// Wind the triangle so the inside is where the edge functions are positive
+		int64_t nArea = (int64_t)(x2 - x1) * (y3 - y1) - (int64_t)(y2 - y1) * (x3 - x1);
+		if (nArea == 0) return;
+		if (nArea < 0) { std::swap(x2, x3); std::swap(y2, y3); }
+
+		int32_t ys = std::max(std::min({ y1, y2, y3 }), w.nClipY0);
+		int32_t ye = std::min(std::max({ y1, y2, y3 }), w.nClipY1 - 1);
+		int32_t xs = std::max(std::min({ x1, x2, x3 }), w.nClipX0);
+		int32_t xe = std::min(std::max({ x1, x2, x3 }), w.nClipX1 - 1);
+		if (ys > ye || xs > xe) return;
+
+		// E(x,y) = A*x + B*y + C for the edge from (px,py) to (qx,qy), with the
+		// bias taking one off edges that are neither top nor left
+		struct sEdge { int64_t A, B, C; };
+		auto Edge = [](int32_t px, int32_t py, int32_t qx, int32_t qy)
+		{
+			sEdge e;
+			e.A = (int64_t)py - qy;
+			e.B = (int64_t)qx - px;
+			e.C = -(e.A * px + e.B * py);
+			bool bTopLeft = (qy == py && qx > px) || qy < py;
+			if (!bTopLeft) e.C -= 1;
+			return e;
+		};
+		const sEdge vEdges[3] = { Edge(x1, y1, x2, y2), Edge(x2, y2, x3, y3), Edge(x3, y3, x1, y1) };
+
+		auto FloorDiv = [](int64_t a, int64_t b) { return a >= 0 ? a / b : -((-a + b - 1) / b); };
+
+		for (int32_t y = ys; y <= ye; y++)
+		{
+			// A*x + K >= 0 for every edge
+			int64_t l = xs, r = xe;
+			for (const sEdge& e : vEdges)
+			{
+				int64_t K = e.B * y + e.C;
+				if (e.A > 0) l = std::max(l, -FloorDiv(K, e.A));
+				else if (e.A < 0) r = std::min(r, FloorDiv(K, -e.A));
+				else if (K < 0) { r = l - 1; break; }
+			}
+			if (l <= r) fSpan((int32_t)l, y, (int32_t)(r - l + 1));
+		}
+	}
+
+	template<class W>
+	void jpr_RasterFillTriangle(const W& w, int32_t x1, int32_t y1, int32_t x2, int32_t y2, int32_t x3, int32_t y3, Pixel p)
+	{
+		jpr_RasterTriangleSpans(w, x1, y1, x2, y2, x3, y3, [&](int32_t x, int32_t y, int32_t n) { w.Fill(x, y, n, p); });
+	}
+
+	// Fills a triangle with colours interpolated between its corners. Each channel
+	// is a plane c1 + dx*(x-x1) + dy*(y-y1) through the three corner colours
+	template<class W>
+	void jpr_RasterShadeTriangle(const W& w, int32_t x1, int32_t y1, int32_t x2, int32_t y2, int32_t x3, int32_t y3, Pixel c1, Pixel c2, Pixel c3)
+	{
+		double fArea = (double)((int64_t)(x2 - x1) * (y3 - y1) - (int64_t)(y2 - y1) * (x3 - x1));
+		if (fArea == 0.0) return;
+
+		double vBase[4], vDx[4], vDy[4];
+		for (int i = 0; i < 4; i++)
+		{
+			double a = (&c1.r)[i], b = (double)(&c2.r)[i] - a, c = (double)(&c3.r)[i] - a;
+			vDx[i] = (b * (y3 - y1) - c * (y2 - y1)) / fArea;
+			vDy[i] = (c * (x2 - x1) - b * (x3 - x1)) / fArea;
+			vBase[i] = a + 0.5 - vDx[i] * x1 - vDy[i] * y1;
+		}
+
+		Pixel vRow[256];
+		jpr_RasterTriangleSpans(w, x1, y1, x2, y2, x3, y3, [&](int32_t x, int32_t y, int32_t n)
+		{
+			double vRowBase[4];
+			for (int i = 0; i < 4; i++) vRowBase[i] = vBase[i] + vDy[i] * y;
+			for (int32_t k0 = 0; k0 < n; k0 += 256)
+			{
+				int32_t m = std::min(256, n - k0);
+				for (int32_t k = 0; k < m; k++)
+				{
+					double px = (double)(x + k0 + k);
+					uint8_t v[4];
+					for (int i = 0; i < 4; i++)
+						v[i] = (uint8_t)std::min(255.0, std::max(0.0, vRowBase[i] + vDx[i] * px));
+					vRow[k] = Pixel(v[0], v[1], v[2], v[3]);
+				}
+				w.Copy(x + k0, y, vRow, m);
+			}
+		});
+	}
+
+	// Texel (x,y) of a view, with what Sprite::GetPixel() makes of texels outside it
+	inline Pixel jpr_ViewPixel(const SpriteView& src, Sprite::Mode mode, int32_t x, int32_t y)
+	{
+		if (mode == Sprite::PERIODIC && src.width > 0 && src.height > 0)
+			return *src.At(abs(x % src.width), abs(y % src.height));
+		if (x >= 0 && x < src.width && y >= 0 && y < src.height)
+			return *src.At(x, y);
+		return Pixel(0, 0, 0, 0);
+	}
+
+	// Draws the w x h area of src at (ox,oy), each texel covering a scale x scale
+	// block. The destination is clipped once, each source row is expanded into a
+	// scratch span and that span is handed to the writer once per output row
+	template<class W>
+	void jpr_RasterPartialSprite(const W& wr, int32_t x, int32_t y, const SpriteView& src, Sprite::Mode mode, int32_t ox, int32_t oy, int32_t w, int32_t h, uint32_t scale, uint8_t flip)
+	{
+		bool bFlipX = (flip & Sprite::HORIZ) != 0;
+		bool bFlipY = (flip & Sprite::VERT) != 0;
+		if (w <= 0 || h <= 0) return;
+		int32_t s = scale > 1 ? (int32_t)scale : 1;
+
+		int32_t dx0 = std::max(x, wr.nClipX0), dx1 = (int32_t)std::min<int64_t>((int64_t)x + (int64_t)w * s, wr.nClipX1);
+		int32_t dy0 = std::max(y, wr.nClipY0), dy1 = (int32_t)std::min<int64_t>((int64_t)y + (int64_t)h * s, wr.nClipY1);
+		if (dx1 <= dx0 || dy1 <= dy0) return;
+		int32_t n = dx1 - dx0;
+
+		// First texel column written, and how far into its block the clip starts
+		int32_t i0 = (dx0 - x) / s, r0 = (dx0 - x) % s;
+		int32_t sx = ox + (bFlipX ? w - 1 - i0 : i0);
+		bool bPeriodic = mode == Sprite::PERIODIC;
+		bool bColumns = s == 1 && !bPeriodic && !bFlipX && sx >= 0 && sx + n <= src.width;
+
+		Pixel vRow[256];
+		for (int32_t ty = dy0; ty < dy1; )
+		{
+			int32_t j = (ty - y) / s;
+			int32_t tyEnd = std::min(dy1, y + (j + 1) * s);
+			int32_t sy = oy + (bFlipY ? h - 1 - j : j);
+			bool bRow = !bPeriodic && sy >= 0 && sy < src.height;
+			const Pixel* pRow = bRow ? src.At(0, sy) : nullptr;
+
+			if (bRow && bColumns)
+			{
+				wr.Copy(dx0, ty++, pRow + sx, n);
+				continue;
+			}
+
+			// Expand the row a chunk at a time, jpr_ViewPixel() supplies what the
+			// sample mode makes of texels outside the source
+			int32_t si = sx, r = r0;
+			Pixel p = (bRow && si >= 0 && si < src.width) ? pRow[si] : jpr_ViewPixel(src, mode, si, sy);
+			for (int32_t k0 = 0; k0 < n; k0 += 256)
+			{
+				int32_t m = std::min(256, n - k0);
+				for (int32_t k = 0; k < m; k++)
+				{
+					if (r == s)
+					{
+						r = 0;
+						si += bFlipX ? -1 : 1;
+						p = (bRow && si >= 0 && si < src.width) ? pRow[si] : jpr_ViewPixel(src, mode, si, sy);
+					}
+					vRow[k] = p;
+					r++;
+				}
+				for (int32_t t = ty; t < tyEnd; t++)
+					wr.Copy(dx0 + k0, t, vRow, m);
+			}
+			ty = tyEnd;
+		}
+	}
+
+	template<class W>
+	void jpr_RasterSprite(const W& w, int32_t x, int32_t y, const SpriteView& src, Sprite::Mode mode, uint32_t scale, uint8_t flip)
+	{
+		jpr_RasterPartialSprite(w, x, y, src, mode, 0, 0, src.width, src.height, scale, flip);
+	}
+
+	// Draws text from the 1-bit glyph rows built by jpr_ConstructFontSheet(). Each
+	// run of lit texels in a glyph row becomes one span per output row, and glyphs
+	// wholly inside the clip rectangle skip the per-span clipping
+	template<class W>
+	void jpr_RasterString(const W& w, int32_t x, int32_t y, const std::string& sText, Pixel col, uint32_t scale, const uint8_t (*pGlyphs)[8])
+	{
+		int32_t s = scale > 1 ? (int32_t)scale : 1;
+		int32_t gs = 8 * s;
+		int32_t sx = 0;
+		int32_t sy = 0;
+		for (auto c : sText)
+		{
+			if (c == '\n')
+			{
+				sx = 0; sy += gs;
+				continue;
+			}
+
+			int32_t g = (int32_t)(uint8_t)c - 32;
+			int32_t gx = x + sx, gy = y + sy;
+			sx += gs;
+			if (g < 0 || g >= 96) continue;
+			if (gx >= w.nClipX1 || gy >= w.nClipY1 || gx + gs <= w.nClipX0 || gy + gs <= w.nClipY0) continue;
+
+			bool bInside = gx >= w.nClipX0 && gy >= w.nClipY0 && gx + gs <= w.nClipX1 && gy + gs <= w.nClipY1;
+			for (int32_t j = 0; j < 8; j++)
+			{
+				uint32_t bits = pGlyphs[g][j];
+				int32_t i = 0;
+				while (bits)
+				{
+					while (!(bits & 1)) { bits >>= 1; i++; }
+					int32_t n = 0;
+					while (bits & 1) { bits >>= 1; n++; }
+
+					int32_t rx = gx + i * s, ry = gy + j * s;
+					for (int32_t r = ry; r < ry + s; r++)
+						if (bInside) w.Fill(rx, r, n * s, col);
+						else w.HSpan(rx, rx + n * s - 1, r, col);
+					i += n;
+				}
+			}
+		}
+	}
+
+	template<class F>
+	void RetroGameEngine::jpr_WithPixelWriter(F&& f)
+	{
+		if (!pDrawTarget) return;
+		jpr_WithPixelWriter(pDrawTarget, nPixelMode, fBlendFactor, &funcPixelMode, 0, 0, pDrawTarget->width, pDrawTarget->height, f);
+	}
+
+	template<class F>
+	void RetroGameEngine::jpr_WithPixelWriter(Sprite* pTarget, Pixel::Mode m, float fBlend, const std::function<jpr::Pixel(const int x, const int y, const jpr::Pixel&, const jpr::Pixel&)>* pFunc,
+		int32_t x0, int32_t y0, int32_t x1, int32_t y1, F&& f)
+	{
+		auto Setup = [&](auto& w)
+		{
+			w.pData = pTarget->GetData();
+			w.nPitch = pTarget->GetPitch();
+			w.nWidth = pTarget->width;
+			w.nHeight = pTarget->height;
+			w.nClipX0 = x0;
+			w.nClipY0 = y0;
+			w.nClipX1 = x1;
+			w.nClipY1 = y1;
+#ifdef JPR_DBG_OVERDRAW
+			std::vector<uint16_t>& v = pTarget->vOverdraw;
+			if (v.size() != (size_t)w.nWidth * w.nHeight) v.assign((size_t)w.nWidth * w.nHeight, 0);
+			w.pOverdraw = v.data();
+			w.pPrimitivePixels = &nDbgPrimitivePixels[nDbgPrimitive];
+#endif
+		};
+
+		switch (m)
+		{
+		case Pixel::NORMAL: { PixelWriterNormal w; Setup(w); f(w); break; }
+		case Pixel::MASK:   { PixelWriterMask w; Setup(w); f(w); break; }
+		case Pixel::ALPHA:  { PixelWriterAlpha w; Setup(w); w.fBlend = fBlend; w.nBlend = jpr_BlendFactor(fBlend); f(w); break; }
+		case Pixel::CUSTOM: { PixelWriterCustom w; Setup(w); w.pFunc = pFunc; f(w); break; }
+		}
+	}
+
+	template<class W>
+	void RetroGameEngine::jpr_RasterCommand(const W& w, const DisplayList& dl, const DisplayList::sCommand& c)
+	{
+		switch (c.nType)
+		{
+		case DisplayList::CMD_DRAW:				w.Plot(c.v[0], c.v[1], c.p); break;
+		case DisplayList::CMD_DRAWLINE:			jpr_RasterLine(w, c.v[0], c.v[1], c.v[2], c.v[3], c.p, c.n); break;
+		case DisplayList::CMD_DRAWCIRCLE:		jpr_RasterCircle(w, c.v[0], c.v[1], c.v[2], c.p, (uint8_t)c.n); break;
+		case DisplayList::CMD_FILLCIRCLE:		jpr_RasterFillCircle(w, c.v[0], c.v[1], c.v[2], c.p); break;
+		case DisplayList::CMD_FILLRECT:			jpr_RasterFillRect(w, c.v[0], c.v[1], c.v[2], c.v[3], c.p); break;
+		case DisplayList::CMD_FILLTRIANGLE:		jpr_RasterFillTriangle(w, c.v[0], c.v[1], c.v[2], c.v[3], c.v[4], c.v[5], c.p); break;
+		case DisplayList::CMD_DRAWSTRING:		jpr_RasterString(w, c.v[0], c.v[1], dl.vText[c.v[2]], c.p, c.n, nFontGlyphs); break;
+		case DisplayList::CMD_SHADETRIANGLE:	jpr_RasterShadeTriangle(w, c.v[0], c.v[1], c.v[2], c.v[3], c.v[4], c.v[5], dl.vColours[c.n], dl.vColours[c.n + 1], dl.vColours[c.n + 2]); break;
+		case DisplayList::CMD_DRAWSPRITE:
+		case DisplayList::CMD_DRAWPARTIALSPRITE:
+		{
+			// Views are always sampled as NORMAL
+			SpriteView src = c.pSprite ? c.pSprite->GetView() : c.view;
+			Sprite::Mode mode = c.pSprite ? c.pSprite->GetSampleMode() : Sprite::NORMAL;
+			if (c.nType == DisplayList::CMD_DRAWSPRITE)
+				jpr_RasterSprite(w, c.v[0], c.v[1], src, mode, c.n, c.nFlip);
+			else
+				jpr_RasterPartialSprite(w, c.v[0], c.v[1], src, mode, c.v[2], c.v[3], c.v[4], c.v[5], c.n, c.nFlip);
+			break;
+		}
+		}
+	}
+
+	bool RetroGameEngine::Draw(int32_t x, int32_t y, Pixel p)
+	{
+		JPR_DBG_PRIMITIVE(DBG_DRAW);
+		jpr_MarkDirty(x, y, x + 1, y + 1);
+		if (pRecording)
+		{
+			DisplayList::sCommand& c = jpr_Record(DisplayList::CMD_DRAW, x, y, x + 1, y + 1);
+			c.v[0] = x; c.v[1] = y; c.p = p;
+			return true;
+		}
+		bool bDrawn = false;
+		jpr_WithPixelWriter([&](const auto& w) { bDrawn = w.Plot(x, y, p); });
+		return bDrawn;
+	}
+
+	void RetroGameEngine::SetSubPixelOffset(float ox, float oy)
+	{
+		fSubPixelOffsetX = ox * fPixelX;
+		fSubPixelOffsetY = oy * fPixelY;
+	}
+
+	void RetroGameEngine::DrawLine(int32_t x1, int32_t y1, int32_t x2, int32_t y2, Pixel p, uint32_t pattern)
+	{
+		JPR_DBG_PRIMITIVE(DBG_DRAWLINE);
+		jpr_MarkDirty(std::min(x1, x2), std::min(y1, y2), std::max(x1, x2) + 1, std::max(y1, y2) + 1);
+		if (pRecording)
+		{
+			DisplayList::sCommand& c = jpr_Record(DisplayList::CMD_DRAWLINE, std::min(x1, x2), std::min(y1, y2), std::max(x1, x2) + 1, std::max(y1, y2) + 1);
+			c.v[0] = x1; c.v[1] = y1; c.v[2] = x2; c.v[3] = y2; c.p = p; c.n = pattern;
+			return;
+		}
+		jpr_WithPixelWriter([&](const auto& w) { jpr_RasterLine(w, x1, y1, x2, y2, p, pattern); });
+	}
+
+	void RetroGameEngine::DrawLines(const std::vector<jpr::vi2d>& vPoints, Pixel p, uint32_t pattern)
+	{
+		jpr_DrawSegments(vPoints.data(), vPoints.size(), vPoints.size() / 2, 2, p, pattern);
+	}
+
+	void RetroGameEngine::DrawPolyline(const std::vector<jpr::vi2d>& vPoints, Pixel p, uint32_t pattern, bool bClosed)
+	{
+		size_t n = vPoints.size();
+		if (n < 2) return;
+		jpr_DrawSegments(vPoints.data(), n, (bClosed && n > 2) ? n : n - 1, 1, p, pattern);
+	}
+
+	// Segment i runs from point i*nStride to the one after it, wrapping to the
+	// first. The pixel writer is chosen once for the whole batch
+	void RetroGameEngine::jpr_DrawSegments(const jpr::vi2d* pPoints, size_t nPoints, size_t nSegments, size_t nStride, Pixel p, uint32_t pattern)
+	{
+		JPR_DBG_PRIMITIVE(DBG_DRAWLINE);
+		if (bDirtyTracking || pRecording)
+		{
+			for (size_t i = 0; i < nSegments; i++)
+			{
+				const jpr::vi2d& a = pPoints[i * nStride];
+				const jpr::vi2d& b = pPoints[(i * nStride + 1) % nPoints];
+				jpr_MarkDirty(std::min(a.x, b.x), std::min(a.y, b.y), std::max(a.x, b.x) + 1, std::max(a.y, b.y) + 1);
+				if (pRecording)
+				{
+					DisplayList::sCommand& c = jpr_Record(DisplayList::CMD_DRAWLINE, std::min(a.x, b.x), std::min(a.y, b.y), std::max(a.x, b.x) + 1, std::max(a.y, b.y) + 1);
+					c.v[0] = a.x; c.v[1] = a.y; c.v[2] = b.x; c.v[3] = b.y; c.p = p; c.n = pattern;
+				}
+			}
+			if (pRecording) return;
+		}
+
+		jpr_WithPixelWriter([&](const auto& w)
+		{
+			for (size_t i = 0; i < nSegments; i++)
+			{
+				const jpr::vi2d& a = pPoints[i * nStride];
+				const jpr::vi2d& b = pPoints[(i * nStride + 1) % nPoints];
+				jpr_RasterLine(w, a.x, a.y, b.x, b.y, p, pattern);
+			}
+		});
+	}
+
+	void RetroGameEngine::DrawCircle(int32_t x, int32_t y, int32_t radius, Pixel p, uint8_t mask)
+	{
+		JPR_DBG_PRIMITIVE(DBG_DRAWCIRCLE);
+		if (!radius) return;
+		jpr_MarkDirty(x - radius, y - radius, x + radius + 1, y + radius + 1);
+		if (pRecording)
+		{
+			DisplayList::sCommand& c = jpr_Record(DisplayList::CMD_DRAWCIRCLE, x - radius, y - radius, x + radius + 1, y + radius + 1);
+			c.v[0] = x; c.v[1] = y; c.v[2] = radius; c.p = p; c.n = mask;
+			return;
+		}
+		jpr_WithPixelWriter([&](const auto& w) { jpr_RasterCircle(w, x, y, radius, p, mask); });
+	}
+
+	void RetroGameEngine::FillCircle(int32_t x, int32_t y, int32_t radius, Pixel p)
+	{
+		JPR_DBG_PRIMITIVE(DBG_FILLCIRCLE);
+		if (!radius) return;
+		jpr_MarkDirty(x - radius, y - radius, x + radius + 1, y + radius + 1);
+		if (pRecording)
+		{
+			DisplayList::sCommand& c = jpr_Record(DisplayList::CMD_FILLCIRCLE, x - radius, y - radius, x + radius + 1, y + radius + 1);
+			c.v[0] = x; c.v[1] = y; c.v[2] = radius; c.p = p;
+			return;
+		}
+		jpr_WithPixelWriter([&](const auto& w) { jpr_RasterFillCircle(w, x, y, radius, p); });
+	}
+
+	void RetroGameEngine::DrawRect(int32_t x, int32_t y, int32_t w, int32_t h, Pixel p)
+	{
+		JPR_DBG_PRIMITIVE(DBG_DRAWRECT);
+		DrawLine(x, y, x+w, y, p);
+		DrawLine(x+w, y, x+w, y+h, p);
+		DrawLine(x+w, y+h, x, y+h, p);
+		DrawLine(x, y+h, x, y, p);
+	}
+
+	void RetroGameEngine::Clear(Pixel p)
+	{
+		JPR_DBG_PRIMITIVE(DBG_CLEAR);
+		if (bDeferred) jpr_FlushDeferred();
+		// Row by row, the padding of a view target may belong to someone else
+		Pixel* m = GetDrawTarget()->GetData();
+		int32_t nPitch = GetDrawTarget()->GetPitch();
+		for (int32_t y = 0; y < GetDrawTargetHeight(); y++)
+			std::fill(m + y * nPitch, m + y * nPitch + GetDrawTargetWidth(), p);
+		jpr_MarkDirty(0, 0, GetDrawTargetWidth(), GetDrawTargetHeight());
+#ifdef JPR_DBG_OVERDRAW
+		int pixels = GetDrawTargetWidth() * GetDrawTargetHeight();
+		jpr::Sprite::nOverdrawCount += pixels;
+		nDbgPrimitivePixels[nDbgPrimitive] += pixels;
+		std::vector<uint16_t>& v = GetDrawTarget()->vOverdraw;
+		if (v.size() != (size_t)pixels) v.assign(pixels, 0);
+		for (auto& c : v) c += (c != 0xFFFF);
+#endif
+	}
+
+	void RetroGameEngine::FillRect(int32_t x, int32_t y, int32_t w, int32_t h, Pixel p)
+	{
+		JPR_DBG_PRIMITIVE(DBG_FILLRECT);
+		int32_t x2 = x + w;
+		int32_t y2 = y + h;
+		jpr_MarkDirty(x, y, x2, y2);
+		if (pRecording)
+		{
+			DisplayList::sCommand& c = jpr_Record(DisplayList::CMD_FILLRECT, x, y, x2, y2);
+			c.v[0] = x; c.v[1] = y; c.v[2] = x2; c.v[3] = y2; c.p = p;
+			return;
+		}
+		jpr_WithPixelWriter([&](const auto& wr) { jpr_RasterFillRect(wr, x, y, x2, y2, p); });
 	}
 
-	Pixel* Sprite::GetData() { return pColData; }
-
-	ResourcePack::ResourcePack()
+	void RetroGameEngine::DrawTriangle(int32_t x1, int32_t y1, int32_t x2, int32_t y2, int32_t x3, int32_t y3, Pixel p)
 	{
-
+		JPR_DBG_PRIMITIVE(DBG_DRAWTRIANGLE);
+		DrawLine(x1, y1, x2, y2, p);
+		DrawLine(x2, y2, x3, y3, p);
+		DrawLine(x3, y3, x1, y1, p);
 	}
 
-	ResourcePack::~ResourcePack()
+	void RetroGameEngine::FillTriangle(int32_t x1, int32_t y1, int32_t x2, int32_t y2, int32_t x3, int32_t y3, Pixel p)
 	{
-		ClearPack();
+		JPR_DBG_PRIMITIVE(DBG_FILLTRIANGLE);
+		jpr_MarkDirty(std::min({ x1, x2, x3 }), std::min({ y1, y2, y3 }), std::max({ x1, x2, x3 }) + 1, std::max({ y1, y2, y3 }) + 1);
+		if (pRecording)
+		{
+			DisplayList::sCommand& c = jpr_Record(DisplayList::CMD_FILLTRIANGLE, std::min({ x1, x2, x3 }), std::min({ y1, y2, y3 }), std::max({ x1, x2, x3 }) + 1, std::max({ y1, y2, y3 }) + 1);
+			c.v[0] = x1; c.v[1] = y1; c.v[2] = x2; c.v[3] = y2; c.v[4] = x3; c.v[5] = y3; c.p = p;
+			return;
+		}
+		jpr_WithPixelWriter([&](const auto& w) { jpr_RasterFillTriangle(w, x1, y1, x2, y2, x3, y3, p); });
 	}
 
-	jpr::rcode ResourcePack::AddToPack(std::string sFile)
+	void RetroGameEngine::FillTriangles(const std::vector<jpr::vi2d>& vVertices, const std::vector<uint32_t>& vIndices, const std::vector<Pixel>& vColours, bool bVertexColours)
 	{
-		std::ifstream ifs(sFile, std::ifstream::binary);
-		if (!ifs.is_open()) return jpr::FAIL;
-
-		// Get File Size
-		std::streampos p = 0;
-		p = ifs.tellg();
-		ifs.seekg(0, std::ios::end);
-		p = ifs.tellg() - p;
-		ifs.seekg(0, std::ios::beg);
-
-		// Create entry
-		sEntry e;
-		e.data = nullptr;
-		e.nFileSize = (uint32_t)p;
+		JPR_DBG_PRIMITIVE(DBG_FILLTRIANGLE);
+		size_t nVertices = vVertices.size(), nTriangles = vIndices.size() / 3;
+		bool bSingle = vColours.size() == 1;
+		if (nTriangles == 0 || vColours.empty()) return;
+		if (!bSingle && vColours.size() < (bVertexColours ? nVertices : nTriangles)) return;
+		bVertexColours = bVertexColours && !bSingle;
+
+		// Calls fTriangle(v1, v2, v3, c1, c2, c3) for every triangle with valid indices
+		auto ForEach = [&](auto&& fTriangle)
+		{
+			for (size_t t = 0; t < nTriangles; t++)
+			{
+				uint32_t i1 = vIndices[t * 3], i2 = vIndices[t * 3 + 1], i3 = vIndices[t * 3 + 2];
+				if (i1 >= nVertices || i2 >= nVertices || i3 >= nVertices) continue;
+				if (bVertexColours)
+					fTriangle(vVertices[i1], vVertices[i2], vVertices[i3], vColours[i1], vColours[i2], vColours[i3]);
+				else
+				{
+					const Pixel& c = vColours[bSingle ? 0 : t];
+					fTriangle(vVertices[i1], vVertices[i2], vVertices[i3], c, c, c);
+				}
+			}
+		};
 
-		// Read file into memory
-		e.data = new uint8_t[(uint32_t)e.nFileSize];
-		ifs.read((char*)e.data, e.nFileSize);
-		ifs.close();
+		if (bDirtyTracking || pRecording)
+		{
+			int32_t bx0 = INT32_MAX, by0 = INT32_MAX, bx1 = INT32_MIN, by1 = INT32_MIN;
+			ForEach([&](const jpr::vi2d& a, const jpr::vi2d& b, const jpr::vi2d& c, const Pixel& c1, const Pixel& c2, const Pixel& c3)
+			{
+				int32_t x0 = std::min({ a.x, b.x, c.x }), y0 = std::min({ a.y, b.y, c.y });
+				int32_t x1 = std::max({ a.x, b.x, c.x }) + 1, y1 = std::max({ a.y, b.y, c.y }) + 1;
+				bx0 = std::min(bx0, x0); by0 = std::min(by0, y0);
+				bx1 = std::max(bx1, x1); by1 = std::max(by1, y1);
+				if (!pRecording) return;
+
+				bool bFlat = c1 == c2 && c2 == c3;
+				DisplayList::sCommand& cmd = jpr_Record(bFlat ? DisplayList::CMD_FILLTRIANGLE : DisplayList::CMD_SHADETRIANGLE, x0, y0, x1, y1);
+				cmd.v[0] = a.x; cmd.v[1] = a.y; cmd.v[2] = b.x; cmd.v[3] = b.y; cmd.v[4] = c.x; cmd.v[5] = c.y; cmd.p = c1;
+				if (!bFlat)
+				{
+					cmd.n = (uint32_t)pRecording->vColours.size();
+					pRecording->vColours.insert(pRecording->vColours.end(), { c1, c2, c3 });
+				}
+			});
+			jpr_MarkDirty(bx0, by0, bx1, by1);
+			if (pRecording) return;
+		}
 
-		// Add To Map
-		mapFiles[sFile] = e;
-		return jpr::OK;
+		// One pixel writer for the whole mesh, triangles missing the draw target
+		// are dropped before any edge setup
+		jpr_WithPixelWriter([&](const auto& w)
+		{
+			ForEach([&](const jpr::vi2d& a, const jpr::vi2d& b, const jpr::vi2d& c, const Pixel& c1, const Pixel& c2, const Pixel& c3)
+			{
+				if (std::max({ a.x, b.x, c.x }) < w.nClipX0 || std::min({ a.x, b.x, c.x }) >= w.nClipX1 ||
+					std::max({ a.y, b.y, c.y }) < w.nClipY0 || std::min({ a.y, b.y, c.y }) >= w.nClipY1)
+					return;
+				if (c1 == c2 && c2 == c3)
+					jpr_RasterFillTriangle(w, a.x, a.y, b.x, b.y, c.x, c.y, c1);
+				else
+					jpr_RasterShadeTriangle(w, a.x, a.y, b.x, b.y, c.x, c.y, c1, c2, c3);
+			});
+		});
 	}
 
-	jpr::rcode ResourcePack::SavePack(std::string sFile)
+	void RetroGameEngine::DrawSprite(int32_t x, int32_t y, Sprite *sprite, uint32_t scale, uint8_t flip)
 	{
-		std::ofstream ofs(sFile, std::ofstream::binary);
-		if (!ofs.is_open()) return jpr::FAIL;
-
-		// 1) Write Map
-		size_t nMapSize = mapFiles.size();
-		ofs.write((char*)&nMapSize, sizeof(size_t));
-		for (auto &e : mapFiles)
+		JPR_DBG_PRIMITIVE(DBG_DRAWSPRITE);
+		if (sprite == nullptr)
+			return;
+		// Scale 0 is drawn at scale 1, the bounds have to say so too
+		scale = std::max(scale, 1u);
+		jpr_MarkDirty(x, y, x + sprite->width * (int32_t)scale, y + sprite->height * (int32_t)scale);
+		if (pRecording)
 		{
-			size_t nPathSize = e.first.size();
-			ofs.write((char*)&nPathSize, sizeof(size_t));
-			ofs.write(e.first.c_str(), nPathSize);
-			ofs.write((char*)&e.second.nID, sizeof(uint32_t));
-			ofs.write((char*)&e.second.nFileSize, sizeof(uint32_t));
-			ofs.write((char*)&e.second.nFileOffset, sizeof(uint32_t));
+			DisplayList::sCommand& c = jpr_Record(DisplayList::CMD_DRAWSPRITE, x, y, x + sprite->width * (int32_t)scale, y + sprite->height * (int32_t)scale);
+			c.v[0] = x; c.v[1] = y; c.pSprite = sprite; c.n = scale; c.nFlip = flip;
+			return;
 		}
+		jpr_WithPixelWriter([&](const auto& w) { jpr_RasterSprite(w, x, y, sprite->GetView(), sprite->GetSampleMode(), scale, flip); });
+	}
 
-		// 2) Write Data
-		std::streampos offset = ofs.tellp();
-		for (auto &e : mapFiles)
+	void RetroGameEngine::DrawPartialSprite(int32_t x, int32_t y, Sprite *sprite, int32_t ox, int32_t oy, int32_t w, int32_t h, uint32_t scale, uint8_t flip)
+	{
+		JPR_DBG_PRIMITIVE(DBG_DRAWPARTIALSPRITE);
+		if (sprite == nullptr)
+			return;
+		// Scale 0 is drawn at scale 1, the bounds have to say so too
+		scale = std::max(scale, 1u);
+		jpr_MarkDirty(x, y, x + w * (int32_t)scale, y + h * (int32_t)scale);
+		if (pRecording)
 		{
-			e.second.nFileOffset = (uint32_t)offset;
-			ofs.write((char*)e.second.data, e.second.nFileSize);
-			offset += e.second.nFileSize;
+			DisplayList::sCommand& c = jpr_Record(DisplayList::CMD_DRAWPARTIALSPRITE, x, y, x + w * (int32_t)scale, y + h * (int32_t)scale);
+			c.v[0] = x; c.v[1] = y; c.v[2] = ox; c.v[3] = oy; c.v[4] = w; c.v[5] = h; c.pSprite = sprite; c.n = scale; c.nFlip = flip;
+			return;
 		}
+		jpr_WithPixelWriter([&](const auto& wr) { jpr_RasterPartialSprite(wr, x, y, sprite->GetView(), sprite->GetSampleMode(), ox, oy, w, h, scale, flip); });
+	}
 
-		// 3) Rewrite Map (it has been updated with offsets now)
-		ofs.seekp(std::ios::beg);
-		ofs.write((char*)&nMapSize, sizeof(size_t));
-		for (auto &e : mapFiles)
+	void RetroGameEngine::DrawSprite(int32_t x, int32_t y, const SpriteView& view, uint32_t scale, uint8_t flip)
+	{
+		JPR_DBG_PRIMITIVE(DBG_DRAWSPRITE);
+		// Scale 0 is drawn at scale 1, the bounds have to say so too
+		scale = std::max(scale, 1u);
+		jpr_MarkDirty(x, y, x + view.width * (int32_t)scale, y + view.height * (int32_t)scale);
+		if (pRecording)
 		{
-			size_t nPathSize = e.first.size();
-			ofs.write((char*)&nPathSize, sizeof(size_t));
-			ofs.write(e.first.c_str(), nPathSize);
-			ofs.write((char*)&e.second.nID, sizeof(uint32_t));
-			ofs.write((char*)&e.second.nFileSize, sizeof(uint32_t));
-			ofs.write((char*)&e.second.nFileOffset, sizeof(uint32_t));
+			DisplayList::sCommand& c = jpr_Record(DisplayList::CMD_DRAWSPRITE, x, y, x + view.width * (int32_t)scale, y + view.height * (int32_t)scale);
+			c.v[0] = x; c.v[1] = y; c.view = view; c.n = scale; c.nFlip = flip;
+			return;
 		}
-		ofs.close();
+		jpr_WithPixelWriter([&](const auto& w) { jpr_RasterSprite(w, x, y, view, Sprite::NORMAL, scale, flip); });
+	}
 
-		return jpr::OK;
+	void RetroGameEngine::DrawPartialSprite(int32_t x, int32_t y, const SpriteView& view, int32_t ox, int32_t oy, int32_t w, int32_t h, uint32_t scale, uint8_t flip)
+	{
+		JPR_DBG_PRIMITIVE(DBG_DRAWPARTIALSPRITE);
+		// Scale 0 is drawn at scale 1, the bounds have to say so too
+		scale = std::max(scale, 1u);
+		jpr_MarkDirty(x, y, x + w * (int32_t)scale, y + h * (int32_t)scale);
+		if (pRecording)
+		{
+			DisplayList::sCommand& c = jpr_Record(DisplayList::CMD_DRAWPARTIALSPRITE, x, y, x + w * (int32_t)scale, y + h * (int32_t)scale);
+			c.v[0] = x; c.v[1] = y; c.v[2] = ox; c.v[3] = oy; c.v[4] = w; c.v[5] = h; c.view = view; c.n = scale; c.nFlip = flip;
+			return;
+		}
+		jpr_WithPixelWriter([&](const auto& wr) { jpr_RasterPartialSprite(wr, x, y, view, Sprite::NORMAL, ox, oy, w, h, scale, flip); });
 	}
 
-	jpr::rcode ResourcePack::LoadPack(std::string sFile)
+	void RetroGameEngine::DrawString(int32_t x, int32_t y, std::string sText, Pixel col, uint32_t scale)
 	{
-		std::ifstream ifs(sFile, std::ifstream::binary);
-		if (!ifs.is_open()) return jpr::FAIL;
+		JPR_DBG_PRIMITIVE(DBG_DRAWSTRING);
+		// Scale 0 is drawn at scale 1, like sprites
+		scale = std::max(scale, 1u);
+		jpr::vi2d size = (bDirtyTracking || pRecording) ? GetTextSize(sText, scale) : jpr::vi2d();
+		jpr_MarkDirty(x, y, x + size.x, y + size.y);
 
-		// 1) Read Map
-		uint32_t nMapEntries;
-		ifs.read((char*)&nMapEntries, sizeof(uint32_t));
-		for (uint32_t i = 0; i < nMapEntries; i++)
+		Pixel::Mode m = nPixelMode;
+		if(col.a != 255)	SetPixelMode(Pixel::ALPHA);
+		else					SetPixelMode(Pixel::MASK);
+
+		if (pRecording)
 		{
-			uint32_t nFilePathSize = 0;
-			ifs.read((char*)&nFilePathSize, sizeof(uint32_t));
+			DisplayList::sCommand& c = jpr_Record(DisplayList::CMD_DRAWSTRING, x, y, x + size.x, y + size.y);
+			c.v[0] = x; c.v[1] = y; c.v[2] = (int32_t)pRecording->vText.size(); c.p = col; c.n = scale;
+			pRecording->vText.push_back(sText);
+		}
+		else
+			jpr_WithPixelWriter([&](const auto& w) { jpr_RasterString(w, x, y, sText, col, scale, nFontGlyphs); });
+		SetPixelMode(m);
+	}
 
-			std::string sFileName(nFilePathSize, ' ');
-			for (uint32_t j = 0; j < nFilePathSize; j++)
-				sFileName[j] = ifs.get();
+	void RetroGameEngine::DrawStringCached(int32_t x, int32_t y, const std::string& sText, Pixel col, uint32_t scale)
+	{
+		// Recorded commands can outlive a cache entry, so display lists and
+		// deferred frames keep the text itself
+		scale = std::max(scale, 1u);
+		jpr::vi2d size = GetTextSize(sText, scale);
+		if (pRecording || (size_t)size.x * size.y * sizeof(Pixel) > nTextCacheBudget)
+		{
+			DrawString(x, y, sText, col, scale);
+			return;
+		}
+		if (size.x <= 0 || size.y <= 0) return;
+		JPR_DBG_PRIMITIVE(DBG_DRAWSTRING);
 
-			sEntry e;
-			e.data = nullptr;
-			ifs.read((char*)&e.nID, sizeof(uint32_t));
-			ifs.read((char*)&e.nFileSize, sizeof(uint32_t));
-			ifs.read((char*)&e.nFileOffset, sizeof(uint32_t));
-			mapFiles[sFileName] = e;
+		std::string sKey = sText;
+		sKey.append((const char*)&col.n, sizeof(col.n));
+		sKey.append((const char*)&scale, sizeof(scale));
+
+		Sprite* pSprite;
+		auto it = mapTextRuns.find(sKey);
+		if (it != mapTextRuns.end())
+		{
+			listTextRuns.splice(listTextRuns.begin(), listTextRuns, it->second);
+			pSprite = it->second->pSprite;
+		}
+		else
+		{
+			size_t nBytes = (size_t)size.x * size.y * sizeof(Pixel);
+			jpr_TrimTextCache(nTextCacheBudget - nBytes);
+			pSprite = CreateTextSprite(sText, col, scale);
+			listTextRuns.push_front({ sKey, pSprite, nBytes });
+			mapTextRuns[sKey] = listTextRuns.begin();
+			nTextCacheBytes += nBytes;
 		}
 
-		// 2) Read Data
-		for (auto &e : mapFiles)
+		Pixel::Mode m = nPixelMode;
+		if (col.a != 255)	SetPixelMode(Pixel::ALPHA);
+		else				SetPixelMode(Pixel::MASK);
+		DrawSprite(x, y, pSprite);
+		SetPixelMode(m);
+	}
+
+	jpr::vi2d RetroGameEngine::GetTextSize(const std::string& sText, uint32_t scale)
+	{
+		int32_t nCols = 0, nRows = 1, nCol = 0;
+		for (auto c : sText)
 		{
-			e.second.data = new uint8_t[(uint32_t)e.second.nFileSize];
-			ifs.seekg(e.second.nFileOffset);
-			ifs.read((char*)e.second.data, e.second.nFileSize);
-			e.second._config();
+			if (c == '\n') { nCol = 0; nRows++; }
+			else nCols = std::max(nCols, ++nCol);
 		}
+		int32_t s = scale > 1 ? (int32_t)scale : 1;
+		return jpr::vi2d(nCols * 8 * s, nRows * 8 * s);
+	}
 
-		ifs.close();
-		return jpr::OK;
+	Sprite* RetroGameEngine::CreateTextSprite(const std::string& sText, Pixel col, uint32_t scale)
+	{
+		jpr::vi2d size = GetTextSize(sText, scale);
+		if (size.x <= 0 || size.y <= 0) return nullptr;
+
+		Sprite* pSprite = new Sprite(size.x, size.y, SpriteAllocator::Heap());
+		std::fill(pSprite->GetData(), pSprite->GetData() + pSprite->GetPitch() * size.y, jpr::BLANK);
+		jpr_WithPixelWriter(pSprite, Pixel::NORMAL, 1.0f, nullptr, 0, 0, size.x, size.y,
+			[&](const auto& w) { jpr_RasterString(w, 0, 0, sText, col, scale, nFontGlyphs); });
+		return pSprite;
 	}
 
-	jpr::ResourcePack::sEntry ResourcePack::GetStreamBuffer(std::string sFile)
+	void RetroGameEngine::SetTextCacheBudget(size_t nBytes)
 	{
-		return mapFiles[sFile];
+		nTextCacheBudget = nBytes;
+		jpr_TrimTextCache(nBytes);
 	}
 
-	jpr::rcode ResourcePack::ClearPack()
+	void RetroGameEngine::ClearTextCache()
 	{
-		for (auto &e : mapFiles)
+		jpr_TrimTextCache(0);
+	}
+
+	void RetroGameEngine::jpr_TrimTextCache(size_t nBudget)
+	{
+		while (nTextCacheBytes > nBudget && !listTextRuns.empty())
 		{
-			if (e.second.data != nullptr)
-				delete[] e.second.data;
+			sTextRun& r = listTextRuns.back();
+			nTextCacheBytes -= r.nBytes;
+			delete r.pSprite;
+			mapTextRuns.erase(r.sKey);
+			listTextRuns.pop_back();
 		}
+	}
 
-		mapFiles.clear();
-		return jpr::OK;
+#ifdef JPR_DBG_OVERDRAW
+	uint64_t RetroGameEngine::GetOverdrawPixels(DbgPrimitive p)
+	{
+		return nDbgPrimitivePixels[p];
 	}
 
-	RetroGameEngine::RetroGameEngine()
+	const char* RetroGameEngine::GetPrimitiveName(DbgPrimitive p)
 	{
-		sAppName = "Undefined";
-		jpr::PGEX::pge = this;
+		static const char* sNames[DBG_PRIMITIVE_COUNT] =
+		{
+			"Draw", "DrawLine", "DrawCircle", "FillCircle", "DrawRect", "FillRect",
+			"DrawTriangle", "FillTriangle", "DrawSprite", "DrawPartialSprite",
+			"DrawString", "Clear", "Other"
+		};
+		return sNames[p];
 	}
 
-	jpr::rcode RetroGameEngine::Construct(uint32_t screen_w, uint32_t screen_h, uint32_t pixel_w, uint32_t pixel_h, bool full_screen, bool vsync)
+	void RetroGameEngine::DrawOverdrawHeatmap(float fOpacity, uint16_t nMaxWrites)
 	{
-		nScreenWidth = screen_w;
-		nScreenHeight = screen_h;
-		nPixelWidth = pixel_w;
-		nPixelHeight = pixel_h;
-		bFullScreen = full_screen;
-		bEnableVSYNC = vsync;
+		Sprite* pScreen = pDefaultDrawTarget;
+		if (!pScreen || pScreen->vOverdraw.empty()) return;
+		nMaxWrites = std::max<uint16_t>(nMaxWrites, 2);
 
-		fPixelX = 2.0f / (float)(nScreenWidth);
-		fPixelY = 2.0f / (float)(nScreenHeight);
+		// Blue, cyan, green, yellow, red
+		const Pixel vRamp[5] = { Pixel(0, 0, 255), Pixel(0, 255, 255), Pixel(0, 255, 0), Pixel(255, 255, 0), Pixel(255, 0, 0) };
+		uint32_t nBlend = jpr_BlendFactor(fOpacity);
 
-		if (nPixelWidth == 0 || nPixelHeight == 0 || nScreenWidth == 0 || nScreenHeight == 0)
-			return jpr::FAIL;
+		const uint16_t* c = pScreen->vOverdraw.data();
+		for (int32_t y = 0; y < pScreen->height; y++)
+		for (int32_t x = 0; x < pScreen->width; x++)
+		{
+			size_t i = (size_t)y * pScreen->width + x;
+			if (c[i] == 0) continue;
+			// Position along the ramp in 1/256ths, 1 write is the start and nMaxWrites the end
+			uint32_t t = (std::min(c[i], nMaxWrites) - 1) * 4 * 256 / (nMaxWrites - 1);
+			uint32_t k = std::min(t >> 8, 3u), f = t - (k << 8);
+			Pixel h(
+				(uint8_t)((vRamp[k].r * (256 - f) + vRamp[k + 1].r * f) >> 8),
+				(uint8_t)((vRamp[k].g * (256 - f) + vRamp[k + 1].g * f) >> 8),
+				(uint8_t)((vRamp[k].b * (256 - f) + vRamp[k + 1].b * f) >> 8));
+			Pixel& d = pScreen->GetData()[y * pScreen->GetPitch() + x];
+			d = jpr_BlendPixel(h, d, nBlend);
+		}
 
-#if defined(_WIN32) && defined(UNICODE) && !defined(__MINGW32__)
-		wsAppName = ConvertS2W(sAppName);
+		MarkDirty(0, 0, pScreen->width, pScreen->height);
+	}
 #endif
-		// Load the default font sheet
-		jpr_ConstructFontSheet();
 
-		// Create a sprite that represents the primary drawing target
-		pDefaultDrawTarget = new Sprite(nScreenWidth, nScreenHeight);
-		SetDrawTarget(nullptr);
-		return jpr::OK;
+	DisplayList::~DisplayList()
+	{
+		delete pCache;
 	}
 
-
-	void RetroGameEngine::SetScreenSize(int w, int h)
+	uint32_t DisplayList::Size()
 	{
-		delete pDefaultDrawTarget;
-		nScreenWidth = w;
-		nScreenHeight = h;
-		pDefaultDrawTarget = new Sprite(nScreenWidth, nScreenHeight);
-		SetDrawTarget(nullptr);
-		glClear(GL_COLOR_BUFFER_BIT);
-
-#if defined(_WIN32)
-		SwapBuffers(glDeviceContext);
-#endif
+		return (uint32_t)vCommands.size();
+	}
 
-#if defined(__linux__)
-		glXSwapBuffers(jpr_Display, jpr_Window);
-#endif
+	void DisplayList::Clear()
+	{
+		vCommands.clear();
+		vStates.clear();
+		vText.clear();
+		vColours.clear();
+		Invalidate();
+	}
 
-		glClear(GL_COLOR_BUFFER_BIT);
-		jpr_UpdateViewport();
+	void DisplayList::SetCaching(bool bEnable)
+	{
+		bCaching = bEnable;
+		if (!bCaching) Invalidate();
 	}
 
-	jpr::rcode RetroGameEngine::Start()
+	void DisplayList::Invalidate()
 	{
-		// Construct the window
-		if (!jpr_WindowCreate())
-			return jpr::FAIL;
+		delete pCache;
+		pCache = nullptr;
+		nDraws = 0;
+		bCacheable = true;
+	}
 
-		// Start the thread
-		bAtomActive = true;
-		std::thread t = std::thread(&RetroGameEngine::EngineThread, this);
+	bool DisplayList::jpr_SameCalls(const DisplayList& other) const
+	{
+		if (vCommands.size() != other.vCommands.size() || vStates.size() != other.vStates.size() ||
+			vText != other.vText || vColours.size() != other.vColours.size())
+			return false;
 
-#if defined(_WIN32)
-		// Handle Windows Message Loop
-		MSG msg;
-		while (GetMessage(&msg, NULL, 0, 0) > 0)
+		for (size_t i = 0; i < vStates.size(); i++)
 		{
-			TranslateMessage(&msg);
-			DispatchMessage(&msg);
+			const sState& a = vStates[i], &b = other.vStates[i];
+			if (a.nMode != b.nMode || a.fBlend != b.fBlend || a.nFuncVersion != b.nFuncVersion)
+				return false;
 		}
-#endif
 
-		// Wait for thread to be exited
-		t.join();
-		return jpr::OK;
-	}
+		for (size_t i = 0; i < vColours.size(); i++)
+			if (vColours[i].n != other.vColours[i].n) return false;
 
-	void RetroGameEngine::SetDrawTarget(Sprite *target)
-	{
-		if (target)
-			pDrawTarget = target;
-		else
-			pDrawTarget = pDefaultDrawTarget;
+		for (size_t i = 0; i < vCommands.size(); i++)
+		{
+			const sCommand& a = vCommands[i], &b = other.vCommands[i];
+			if (a.nType != b.nType || a.nState != b.nState || a.x0 != b.x0 || a.y0 != b.y0 ||
+				a.x1 != b.x1 || a.y1 != b.y1 || !std::equal(a.v, a.v + 6, b.v) || a.n != b.n ||
+				a.nFlip != b.nFlip || a.p.n != b.p.n || a.pSprite != b.pSprite ||
+				a.view.pData != b.view.pData || a.view.width != b.view.width ||
+				a.view.height != b.view.height || a.view.pitch != b.view.pitch)
+				return false;
+		}
+		return true;
 	}
 
-	Sprite* RetroGameEngine::GetDrawTarget()
+	void RetroGameEngine::BeginDisplayList(DisplayList* list)
 	{
-		return pDrawTarget;
+		if (!list) return;
+		if (pUserList) EndDisplayList();
+
+		dlUserRecord.vCommands.clear();
+		dlUserRecord.vStates.clear();
+		dlUserRecord.vText.clear();
+		dlUserRecord.vColours.clear();
+		pUserList = list;
+		jpr_UpdateRecording();
 	}
 
-	int32_t RetroGameEngine::GetDrawTargetWidth()
+	void RetroGameEngine::EndDisplayList()
 	{
-		if (pDrawTarget)
-			return pDrawTarget->width;
-		else
-			return 0;
-	}
+		if (!pUserList) return;
 
-	int32_t RetroGameEngine::GetDrawTargetHeight()
-	{
-		if (pDrawTarget)
-			return pDrawTarget->height;
-		else
-			return 0;
+		// Only a change in the calls drops the list's cache, the old ones are
+		// swapped into the scratch list so its storage is reused next time
+		if (!pUserList->jpr_SameCalls(dlUserRecord))
+		{
+			std::swap(pUserList->vCommands, dlUserRecord.vCommands);
+			std::swap(pUserList->vStates, dlUserRecord.vStates);
+			std::swap(pUserList->vText, dlUserRecord.vText);
+			std::swap(pUserList->vColours, dlUserRecord.vColours);
+			pUserList->Invalidate();
+		}
+		pUserList = nullptr;
+		jpr_UpdateRecording();
 	}
 
-	bool RetroGameEngine::IsFocused()
+	void RetroGameEngine::DrawDisplayList(DisplayList* list, int32_t ox, int32_t oy)
 	{
-		return bHasInputFocus;
-	}
+		if (!list || list == pUserList) return;
+
+		// While recording, the calls are copied rather than the cache sprite, which
+		// the list may free before the recording is drawn
+		if (!pRecording)
+		{
+			// Flatten on the second draw, by then the list is known to be reused
+			if (list->bCaching && list->bCacheable && !list->pCache && ++list->nDraws >= 2)
+				list->bCacheable = jpr_FlattenDisplayList(list);
+
+			if (list->pCache)
+			{
+				Pixel::Mode m = nPixelMode;
+				nPixelMode = Pixel::MASK;
+				DrawSprite(list->nCacheX + ox, list->nCacheY + oy, list->pCache);
+				nPixelMode = m;
+				return;
+			}
+		}
 
-	HWButton RetroGameEngine::GetKey(Key k)
-	{
-		return pKeyboardState[k];
+		for (const auto& c : list->vCommands)
+			jpr_ReplayCommand(*list, c, ox, oy);
 	}
 
-	HWButton RetroGameEngine::GetMouse(uint32_t b)
+	void RetroGameEngine::BeginDeferred(uint32_t nTileSize)
 	{
-		return pMouseState[b];
+		if (bDeferred) jpr_FlushDeferred();
+		this->nTileSize = (int32_t)std::max(nTileSize, 8u);
+		bDeferred = true;
+		jpr_UpdateRecording();
 	}
 
-	int32_t RetroGameEngine::GetMouseX()
+	void RetroGameEngine::EndDeferred()
 	{
-		return nMousePosX;
+		if (!bDeferred) return;
+		jpr_FlushDeferred();
+		bDeferred = false;
+		jpr_UpdateRecording();
 	}
 
-	int32_t RetroGameEngine::GetMouseY()
+	void RetroGameEngine::SetRenderThreads(uint32_t nThreads)
 	{
-		return nMousePosY;
+		nRenderThreads = nThreads;
 	}
 
-	int32_t RetroGameEngine::GetMouseWheel()
+	void RetroGameEngine::jpr_UpdateRecording()
 	{
-		return nMouseWheelDelta;
+		pRecording = pUserList ? &dlUserRecord : (bDeferred ? &dlDeferred : nullptr);
 	}
 
-	int32_t RetroGameEngine::ScreenWidth()
+	uint32_t RetroGameEngine::jpr_RecordState(Pixel::Mode m, float fBlend, uint32_t nFuncVersion, const std::function<jpr::Pixel(const int x, const int y, const jpr::Pixel&, const jpr::Pixel&)>& func)
 	{
-		return nScreenWidth;
+		// Pixel mode and blend are only stored when they change
+		std::vector<DisplayList::sState>& v = pRecording->vStates;
+		if (v.empty() || v.back().nMode != m || v.back().fBlend != fBlend ||
+			(m == Pixel::CUSTOM && v.back().nFuncVersion != nFuncVersion))
+			v.push_back({ m, fBlend, nFuncVersion, m == Pixel::CUSTOM ? func : nullptr });
+		return (uint32_t)v.size() - 1;
 	}
 
-	int32_t RetroGameEngine::ScreenHeight()
+	DisplayList::sCommand& RetroGameEngine::jpr_Record(int32_t nType, int32_t x0, int32_t y0, int32_t x1, int32_t y1)
 	{
-		return nScreenHeight;
+		// Changing draw target flushes, so every deferred command shares this one
+		if (pRecording == &dlDeferred) pDeferredTarget = pDrawTarget;
+
+		uint32_t nState = jpr_RecordState(nPixelMode, fBlendFactor, nPixelFuncVersion, funcPixelMode);
+		pRecording->vCommands.emplace_back();
+		DisplayList::sCommand& c = pRecording->vCommands.back();
+		c.nType = nType;
+		c.nState = nState;
+		c.x0 = x0; c.y0 = y0; c.x1 = x1; c.y1 = y1;
+		// Unused fields are zeroed so re-recorded lists compare equal
+		std::fill(c.v, c.v + 6, 0);
+		c.n = 0;
+		c.nFlip = Sprite::NONE;
+		c.p = Pixel(0, 0, 0, 0);
+		c.pSprite = nullptr;
+		c.view = SpriteView();
+#ifdef JPR_DBG_OVERDRAW
+		c.nPrimitive = nDbgPrimitive;
+#endif
+		return c;
 	}
 
-	bool RetroGameEngine::Draw(int32_t x, int32_t y, Pixel p)
+	void RetroGameEngine::jpr_ReplayCommand(const DisplayList& dl, DisplayList::sCommand c, int32_t ox, int32_t oy)
 	{
-		if (!pDrawTarget) return false;
-
-
-		if (nPixelMode == Pixel::NORMAL)
-		{
-			return pDrawTarget->SetPixel(x, y, p);
-		}
-
-		if (nPixelMode == Pixel::MASK)
+		c.x0 += ox; c.x1 += ox; c.y0 += oy; c.y1 += oy;
+		c.v[0] += ox; c.v[1] += oy;
+		bool bTriangle = c.nType == DisplayList::CMD_FILLTRIANGLE || c.nType == DisplayList::CMD_SHADETRIANGLE;
+		if (c.nType == DisplayList::CMD_DRAWLINE || c.nType == DisplayList::CMD_FILLRECT || bTriangle)
 		{
-			if(p.a == 255)
-				return pDrawTarget->SetPixel(x, y, p);
+			c.v[2] += ox; c.v[3] += oy;
 		}
-
-		if (nPixelMode == Pixel::ALPHA)
+		if (bTriangle)
 		{
-			Pixel d = pDrawTarget->GetPixel(x, y);
-			float a = (float)(p.a / 255.0f) * fBlendFactor;
-			float c = 1.0f - a;
-			float r = a * (float)p.r + c * (float)d.r;
-			float g = a * (float)p.g + c * (float)d.g;
-			float b = a * (float)p.b + c * (float)d.b;
-			return pDrawTarget->SetPixel(x, y, Pixel((uint8_t)r, (uint8_t)g, (uint8_t)b));
+			c.v[4] += ox; c.v[5] += oy;
 		}
+		jpr_MarkDirty(c.x0, c.y0, c.x1, c.y1);
 
-		if (nPixelMode == Pixel::CUSTOM)
+		const DisplayList::sState& st = dl.vStates[c.nState];
+		if (pRecording)
 		{
-			return pDrawTarget->SetPixel(x, y, funcPixelMode(x, y, p, pDrawTarget->GetPixel(x, y)));
+			// Into the deferred commands, or another list
+			if (pRecording == &dlDeferred) pDeferredTarget = pDrawTarget;
+			c.nState = jpr_RecordState(st.nMode, st.fBlend, st.nFuncVersion, st.funcPixelMode);
+			if (c.nType == DisplayList::CMD_DRAWSTRING)
+			{
+				pRecording->vText.push_back(dl.vText[c.v[2]]);
+				c.v[2] = (int32_t)pRecording->vText.size() - 1;
+			}
+			if (c.nType == DisplayList::CMD_SHADETRIANGLE)
+			{
+				pRecording->vColours.insert(pRecording->vColours.end(), dl.vColours.begin() + c.n, dl.vColours.begin() + c.n + 3);
+				c.n = (uint32_t)pRecording->vColours.size() - 3;
+			}
+			pRecording->vCommands.push_back(c);
+			return;
 		}
 
-		return false;
-	}
-
-	void RetroGameEngine::SetSubPixelOffset(float ox, float oy)
-	{
-		fSubPixelOffsetX = ox * fPixelX;
-		fSubPixelOffsetY = oy * fPixelY;
+		if (!pDrawTarget) return;
+#ifdef JPR_DBG_OVERDRAW
+		DbgPrimitive nPrev = nDbgPrimitive;
+		nDbgPrimitive = (DbgPrimitive)c.nPrimitive;
+#endif
+		jpr_WithPixelWriter(pDrawTarget, st.nMode, st.fBlend, &st.funcPixelMode, 0, 0, pDrawTarget->width, pDrawTarget->height,
+			[&](const auto& w) { jpr_RasterCommand(w, dl, c); });
+#ifdef JPR_DBG_OVERDRAW
+		nDbgPrimitive = nPrev;
+#endif
 	}
 
-	void RetroGameEngine::DrawLine(int32_t x1, int32_t y1, int32_t x2, int32_t y2, Pixel p, uint32_t pattern)
+	bool RetroGameEngine::jpr_FlattenDisplayList(DisplayList* dl)
 	{
-		int x, y, dx, dy, dx1, dy1, px, py, xe, ye, i;
-		dx = x2 - x1; dy = y2 - y1;
-
-		auto rol = [&](void)
-		{
-			pattern = (pattern << 1) | (pattern >> 31);
-			return pattern & 1;
-		};
+		if (dl->vCommands.empty()) return false;
 
-		// straight lines
-		// Line is vertical
-		if (dx == 0)
+		// The cache is drawn in MASK mode, so it is only the same as replaying if
+		// every pixel the list writes ends up opaque
+		int32_t x0 = dl->vCommands[0].x0, y0 = dl->vCommands[0].y0;
+		int32_t x1 = dl->vCommands[0].x1, y1 = dl->vCommands[0].y1;
+		for (const auto& c : dl->vCommands)
 		{
-			if (y2 < y1) std::swap(y1, y2);
-			for (y = y1; y <= y2; y++)
-				if (rol()) Draw(x1, y, p);
-			return;
+			Pixel::Mode m = dl->vStates[c.nState].nMode;
+			// Sprites and shaded triangles bring their own alpha
+			bool bSprite = c.nType == DisplayList::CMD_DRAWSPRITE || c.nType == DisplayList::CMD_DRAWPARTIALSPRITE || c.nType == DisplayList::CMD_SHADETRIANGLE;
+			if (m != Pixel::MASK && !(m == Pixel::NORMAL && c.p.a == 255 && !bSprite))
+				return false;
+			x0 = std::min(x0, c.x0); y0 = std::min(y0, c.y0);
+			x1 = std::max(x1, c.x1); y1 = std::max(y1, c.y1);
 		}
+		if (x1 <= x0 || y1 <= y0 || (int64_t)(x1 - x0) * (y1 - y0) > 4096 * 4096)
+			return false;
 
-		// Line is horizontal
-		if (dy == 0)
-		{
-			if (x2 < x1) std::swap(x1, x2);
-			for (x = x1; x <= x2; x++)
-				if (rol()) Draw(x, y1, p);
-			return;
-		}
+		dl->pCache = new Sprite(x1 - x0, y1 - y0, SpriteAllocator::Heap());
+		std::fill(dl->pCache->GetData(), dl->pCache->GetData() + dl->pCache->GetPitch() * (y1 - y0), jpr::BLANK);
+		dl->nCacheX = x0;
+		dl->nCacheY = y0;
 
-		// Line is Funk-aye
-		dx1 = abs(dx); dy1 = abs(dy);
-		px = 2 * dy1 - dx1;	py = 2 * dx1 - dy1;
-		if (dy1 <= dx1)
+		for (auto c : dl->vCommands)
 		{
-			if (dx >= 0)
+			c.v[0] -= x0; c.v[1] -= y0;
+			bool bTriangle = c.nType == DisplayList::CMD_FILLTRIANGLE || c.nType == DisplayList::CMD_SHADETRIANGLE;
+			if (c.nType == DisplayList::CMD_DRAWLINE || c.nType == DisplayList::CMD_FILLRECT || bTriangle)
 			{
-				x = x1; y = y1; xe = x2;
+				c.v[2] -= x0; c.v[3] -= y0;
 			}
-			else
+			if (bTriangle)
 			{
-				x = x2; y = y2; xe = x1;
+				c.v[4] -= x0; c.v[5] -= y0;
 			}
+			const DisplayList::sState& st = dl->vStates[c.nState];
+			jpr_WithPixelWriter(dl->pCache, st.nMode, st.fBlend, nullptr, 0, 0, x1 - x0, y1 - y0,
+				[&](const auto& w) { jpr_RasterCommand(w, *dl, c); });
+		}
+		return true;
+	}
 
-			if (rol()) Draw(x, y, p);
+	void RetroGameEngine::jpr_FlushDeferred()
+	{
+		if (dlDeferred.vCommands.empty()) return;
 
-			for (i = 0; x<xe; i++)
-			{
-				x = x + 1;
-				if (px<0)
-					px = px + 2 * dy1;
-				else
-				{
-					if ((dx<0 && dy<0) || (dx>0 && dy>0)) y = y + 1; else y = y - 1;
-					px = px + 2 * (dy1 - dx1);
-				}
-				if (rol()) Draw(x, y, p);
-			}
+		int32_t nWidth = pDeferredTarget->width, nHeight = pDeferredTarget->height;
+		nTilesX = (nWidth + nTileSize - 1) / nTileSize;
+		nTiles = nTilesX * ((nHeight + nTileSize - 1) / nTileSize);
+		if ((int32_t)vTileBins.size() < nTiles) vTileBins.resize(nTiles);
+		for (int32_t t = 0; t < nTiles; t++) vTileBins[t].clear();
+
+		// Bin each command into every tile its bounds overlap, keeping their order
+		for (uint32_t i = 0; i < dlDeferred.Size(); i++)
+		{
+			const DisplayList::sCommand& c = dlDeferred.vCommands[i];
+			int32_t x0 = std::max(c.x0, 0), y0 = std::max(c.y0, 0);
+			int32_t x1 = std::min(c.x1, nWidth), y1 = std::min(c.y1, nHeight);
+			if (x1 <= x0 || y1 <= y0) continue;
+			for (int32_t ty = y0 / nTileSize; ty <= (y1 - 1) / nTileSize; ty++)
+				for (int32_t tx = x0 / nTileSize; tx <= (x1 - 1) / nTileSize; tx++)
+					vTileBins[ty * nTilesX + tx].push_back(i);
 		}
-		else
+
+		uint32_t nThreads = nRenderThreads ? nRenderThreads : std::max(std::thread::hardware_concurrency(), 1u);
+#ifdef JPR_DBG_OVERDRAW
+		// The overdraw counters are not thread safe
+		nThreads = 1;
+#endif
+
+		nNextTile = 0;
+		if (nThreads > 1 && nTiles > 1)
 		{
-			if (dy >= 0)
+			// The calling thread rasterises tiles too
+			if (vRenderWorkers.size() != nThreads - 1)
 			{
-				x = x1; y = y1; ye = y2;
+				jpr_StopRenderWorkers();
+				for (uint32_t i = 1; i < nThreads; i++)
+					vRenderWorkers.emplace_back(&RetroGameEngine::jpr_RenderWorker, this, nRenderJob);
 			}
-			else
+
 			{
-				x = x2; y = y2; ye = y1;
+				std::lock_guard<std::mutex> lock(muxRender);
+				nRenderBusy = (int)vRenderWorkers.size();
+				nRenderJob++;
 			}
+			cvRenderStart.notify_all();
+			jpr_RasterTiles();
 
-			if (rol()) Draw(x, y, p);
+			std::unique_lock<std::mutex> lock(muxRender);
+			cvRenderDone.wait(lock, [&] { return nRenderBusy == 0; });
+		}
+		else
+			jpr_RasterTiles();
+
+		dlDeferred.Clear();
+	}
+
+	void RetroGameEngine::jpr_RasterTiles()
+	{
+#ifdef JPR_DBG_OVERDRAW
+		DbgPrimitive nPrev = nDbgPrimitive;
+#endif
+		int32_t t;
+		while ((t = nNextTile++) < nTiles)
+		{
+			int32_t x0 = (t % nTilesX) * nTileSize, y0 = (t / nTilesX) * nTileSize;
+			int32_t x1 = std::min(x0 + nTileSize, pDeferredTarget->width);
+			int32_t y1 = std::min(y0 + nTileSize, pDeferredTarget->height);
 
-			for (i = 0; y<ye; i++)
+			for (uint32_t i : vTileBins[t])
 			{
-				y = y + 1;
-				if (py <= 0)
-					py = py + 2 * dx1;
-				else
-				{
-					if ((dx<0 && dy<0) || (dx>0 && dy>0)) x = x + 1; else x = x - 1;
-					py = py + 2 * (dx1 - dy1);
-				}
-				if (rol()) Draw(x, y, p);
+				const DisplayList::sCommand& c = dlDeferred.vCommands[i];
+				const DisplayList::sState& st = dlDeferred.vStates[c.nState];
+#ifdef JPR_DBG_OVERDRAW
+				nDbgPrimitive = (DbgPrimitive)c.nPrimitive;
+#endif
+				jpr_WithPixelWriter(pDeferredTarget, st.nMode, st.fBlend, &st.funcPixelMode, x0, y0, x1, y1,
+					[&](const auto& w) { jpr_RasterCommand(w, dlDeferred, c); });
 			}
 		}
+#ifdef JPR_DBG_OVERDRAW
+		nDbgPrimitive = nPrev;
+#endif
 	}
 
-	void RetroGameEngine::DrawCircle(int32_t x, int32_t y, int32_t radius, Pixel p, uint8_t mask)
+	void RetroGameEngine::jpr_RenderWorker(uint64_t nJob)
 	{
-		int x0 = 0;
-		int y0 = radius;
-		int d = 3 - 2 * radius;
-		if (!radius) return;
+		std::unique_lock<std::mutex> lock(muxRender);
+		while (true)
+		{
+			cvRenderStart.wait(lock, [&] { return bRenderQuit || nRenderJob != nJob; });
+			if (bRenderQuit) return;
+			nJob = nRenderJob;
 
-		// only formulate 1/8 of circle
-		while (y0 >= x0)
+			lock.unlock();
+			jpr_RasterTiles();
+			lock.lock();
+
+			if (--nRenderBusy == 0) cvRenderDone.notify_one();
+		}
+	}
+
+	void RetroGameEngine::jpr_StopRenderWorkers()
+	{
 		{
-			if (mask & 0x01) Draw(x + x0, y - y0, p);
-			if (mask & 0x02) Draw(x + y0, y - x0, p);
-			if (mask & 0x04) Draw(x + y0, y + x0, p);
-			if (mask & 0x08) Draw(x + x0, y + y0, p);
-			if (mask & 0x10) Draw(x - x0, y + y0, p);
-			if (mask & 0x20) Draw(x - y0, y + x0, p);
-			if (mask & 0x40) Draw(x - y0, y - x0, p);
-			if (mask & 0x80) Draw(x - x0, y - y0, p);
-			if (d < 0) d += 4 * x0++ + 6;
-			else d += 4 * (x0++ - y0--) + 10;
+			std::lock_guard<std::mutex> lock(muxRender);
+			bRenderQuit = true;
 		}
+		cvRenderStart.notify_all();
+		for (auto& t : vRenderWorkers) t.join();
+		vRenderWorkers.clear();
+		bRenderQuit = false;
 	}
 
-	void RetroGameEngine::FillCircle(int32_t x, int32_t y, int32_t radius, Pixel p)
+	void RetroGameEngine::SetDirtyRectTracking(bool bEnable)
 	{
-		// Taken from wikipedia
-		int x0 = 0;
-		int y0 = radius;
-		int d = 3 - 2 * radius;
-		if (!radius) return;
+		bDirtyTracking = bEnable;
+		nDirtyRects = 0;
+
+		// The first upload after enabling must cover whatever was drawn before
+		MarkDirty(0, 0, nScreenWidth, nScreenHeight);
+	}
+
+	void RetroGameEngine::MarkDirty(int32_t x, int32_t y, int32_t w, int32_t h)
+	{
+		Sprite* pTarget = pDrawTarget;
+		pDrawTarget = pDefaultDrawTarget;
+		jpr_MarkDirty(x, y, x + w, y + h);
+		pDrawTarget = pTarget;
+	}
+
+	void RetroGameEngine::jpr_MarkDirty(int32_t x0, int32_t y0, int32_t x1, int32_t y1)
+	{
+		if (!bDirtyTracking) return;
+		if (pDrawTarget == &sprViewTarget && bViewOnScreen)
+		{
+			// A view of the screen dirties the part of the screen it covers
+			x0 = std::max(x0, 0); y0 = std::max(y0, 0);
+			x1 = std::min(x1, sprViewTarget.width); y1 = std::min(y1, sprViewTarget.height);
+			if (x1 <= x0 || y1 <= y0) return;
+			x0 += nViewTargetX; x1 += nViewTargetX;
+			y0 += nViewTargetY; y1 += nViewTargetY;
+		}
+		else if (pDrawTarget != pDefaultDrawTarget) return;
 
-		auto drawline = [&](int sx, int ex, int ny)
+		x0 = std::max(x0, 0); y0 = std::max(y0, 0);
+		x1 = std::min(x1, (int32_t)nScreenWidth); y1 = std::min(y1, (int32_t)nScreenHeight);
+		if (x1 <= x0 || y1 <= y0) return;
+
+		sDirtyRect r = { x0, y0, x1, y1 };
+		auto Area = [](const sDirtyRect& a) { return (int64_t)(a.x1 - a.x0) * (a.y1 - a.y0); };
+		auto Union = [](const sDirtyRect& a, const sDirtyRect& b)
 		{
-			for (int i = sx; i <= ex; i++)
-				Draw(i, ny, p);
+			return sDirtyRect{ std::min(a.x0, b.x0), std::min(a.y0, b.y0), std::max(a.x1, b.x1), std::max(a.y1, b.y1) };
 		};
 
-		while (y0 >= x0)
+		// Absorb every rectangle this one touches, repeating as it grows
+		bool bMerged = true;
+		while (bMerged)
 		{
-			// Modified to draw scan-lines instead of edges
-			drawline(x - x0, x + x0, y - y0);
-			drawline(x - y0, x + y0, y - x0);
-			drawline(x - x0, x + x0, y + y0);
-			drawline(x - y0, x + y0, y + x0);
-			if (d < 0) d += 4 * x0++ + 6;
-			else d += 4 * (x0++ - y0--) + 10;
+			bMerged = false;
+			for (int i = 0; i < nDirtyRects; i++)
+			{
+				const sDirtyRect& d = vDirtyRects[i];
+				if (r.x0 <= d.x1 && d.x0 <= r.x1 && r.y0 <= d.y1 && d.y0 <= r.y1)
+				{
+					r = Union(r, d);
+					vDirtyRects[i] = vDirtyRects[--nDirtyRects];
+					bMerged = true;
+					break;
+				}
+			}
 		}
+
+		// Out of slots, so merge with whichever rectangle grows the least
+		if (nDirtyRects == nMaxDirtyRects)
+		{
+			int nBest = 0;
+			int64_t nBestGrowth = INT64_MAX;
+			for (int i = 0; i < nDirtyRects; i++)
+			{
+				int64_t nGrowth = Area(Union(r, vDirtyRects[i])) - Area(vDirtyRects[i]);
+				if (nGrowth < nBestGrowth) { nBestGrowth = nGrowth; nBest = i; }
+			}
+			r = Union(r, vDirtyRects[nBest]);
+			vDirtyRects[nBest] = vDirtyRects[--nDirtyRects];
+		}
+
+		vDirtyRects[nDirtyRects++] = r;
 	}
 
-	void RetroGameEngine::DrawRect(int32_t x, int32_t y, int32_t w, int32_t h, Pixel p)
+	void RetroGameEngine::SetThreadedPresent(bool bEnable)
 	{
-		DrawLine(x, y, x+w, y, p);
-		DrawLine(x+w, y, x+w, y+h, p);
-		DrawLine(x+w, y+h, x, y+h, p);
-		DrawLine(x, y+h, x, y, p);
+		bThreadedPresent = bEnable;
 	}
 
-	void RetroGameEngine::Clear(Pixel p)
+	void RetroGameEngine::SetAsyncUpload(bool bEnable, uint32_t nBuffers)
 	{
-		int pixels = GetDrawTargetWidth() * GetDrawTargetHeight();
-		Pixel* m = GetDrawTarget()->GetData();
-		for (int i = 0; i < pixels; i++)
-			m[i] = p;
-#ifdef JPR_DBG_OVERDRAW
-		jpr::Sprite::nOverdrawCount += pixels;
-#endif
+		bAsyncUpload = bEnable;
+		nUploadBuffers = std::max(nBuffers, 2u);
 	}
 
-	void RetroGameEngine::FillRect(int32_t x, int32_t y, int32_t w, int32_t h, Pixel p)
+	bool RetroGameEngine::jpr_CreateUploadBuffers()
 	{
-		int32_t x2 = x + w;
-		int32_t y2 = y + h;
-
-		if (x < 0) x = 0;
-		if (x >= (int32_t)nScreenWidth) x = (int32_t)nScreenWidth;
-		if (y < 0) y = 0;
-		if (y >= (int32_t)nScreenHeight) y = (int32_t)nScreenHeight;
-
-		if (x2 < 0) x2 = 0;
-		if (x2 >= (int32_t)nScreenWidth) x2 = (int32_t)nScreenWidth;
-		if (y2 < 0) y2 = 0;
-		if (y2 >= (int32_t)nScreenHeight) y2 = (int32_t)nScreenHeight;
+#if defined(_WIN32)
+		auto GetProc = [](const char* name) { return (void*)wglGetProcAddress(name); };
+#endif
+#if defined(__linux__)
+		auto GetProc = [](const char* name) { return (void*)glXGetProcAddress((const unsigned char*)name); };
+#endif
+		jpr_glGenBuffers = (glGenBuffers_t*)GetProc("glGenBuffers");
+		jpr_glDeleteBuffers = (glDeleteBuffers_t*)GetProc("glDeleteBuffers");
+		jpr_glBindBuffer = (glBindBuffer_t*)GetProc("glBindBuffer");
+		jpr_glBufferData = (glBufferData_t*)GetProc("glBufferData");
+		jpr_glMapBuffer = (glMapBuffer_t*)GetProc("glMapBuffer");
+		jpr_glUnmapBuffer = (glUnmapBuffer_t*)GetProc("glUnmapBuffer");
+
+		if (!jpr_glGenBuffers || !jpr_glDeleteBuffers || !jpr_glBindBuffer ||
+			!jpr_glBufferData || !jpr_glMapBuffer || !jpr_glUnmapBuffer)
+			return false;
 
-		for (int i = x; i < x2; i++)
-			for (int j = y; j < y2; j++)
-				Draw(i, j, p);
+		vUploadBuffers.resize(nUploadBuffers);
+		jpr_glGenBuffers((GLsizei)nUploadBuffers, vUploadBuffers.data());
+		nUploadBuffer = 0;
+		return true;
 	}
 
-	void RetroGameEngine::DrawTriangle(int32_t x1, int32_t y1, int32_t x2, int32_t y2, int32_t x3, int32_t y3, Pixel p)
+	void RetroGameEngine::jpr_DestroyUploadBuffers()
 	{
-		DrawLine(x1, y1, x2, y2, p);
-		DrawLine(x2, y2, x3, y3, p);
-		DrawLine(x3, y3, x1, y1, p);
+		if (vUploadBuffers.empty()) return;
+		jpr_glDeleteBuffers((GLsizei)vUploadBuffers.size(), vUploadBuffers.data());
+		vUploadBuffers.clear();
 	}
 
-	void RetroGameEngine::FillTriangle(int32_t x1, int32_t y1, int32_t x2, int32_t y2, int32_t x3, int32_t y3, Pixel p)
+	void RetroGameEngine::jpr_UploadRects(const Pixel* pScreen, const sDirtyRect* rects, int n)
 	{
-		auto SWAP = [](int &x, int &y) { int t = x; x = y; y = t; };
-		auto drawline = [&](int sx, int ex, int ny) { for (int i = sx; i <= ex; i++) Draw(i, ny, p); };
-
-		int t1x, t2x, y, minx, maxx, t1xp, t2xp;
-		bool changed1 = false;
-		bool changed2 = false;
-		int signx1, signx2, dx1, dy1, dx2, dy2;
-		int e1, e2;
-
-		// Sort vertices
-		if (y1>y2) { SWAP(y1, y2); SWAP(x1, x2); }
-		if (y1>y3) { SWAP(y1, y3); SWAP(x1, x3); }
-		if (y2>y3) { SWAP(y2, y3); SWAP(x2, x3); }
-
-		// Starting points
-		t1x = t2x = x1; y = y1;
-		dx1 = (int)(x2 - x1); if (dx1<0) { dx1 = -dx1; signx1 = -1; }
-		else signx1 = 1;
-		dy1 = (int)(y2 - y1);
-
-		dx2 = (int)(x3 - x1); if (dx2<0) { dx2 = -dx2; signx2 = -1; }
-		else signx2 = 1;
-		dy2 = (int)(y3 - y1);
-
-		// swap values
-		if (dy1 > dx1) {
-			SWAP(dx1, dy1);
-			changed1 = true;
-		}
-
-		// swap values
-		if (dy2 > dx2) {
-			SWAP(dy2, dx2);
-			changed2 = true;
-		}
-
-		e2 = (int)(dx2 >> 1);
-		// Flat top, just process the second half
-		if (y1 == y2) goto next;
-		e1 = (int)(dx1 >> 1);
-
-		for (int i = 0; i < dx1;) {
-			t1xp = 0; t2xp = 0;
-			if (t1x<t2x) { minx = t1x; maxx = t2x; }
-			else { minx = t2x; maxx = t1x; }
-			// process first line until y value is about to change
-			while (i<dx1) {
-				i++;
-				e1 += dy1;
-				while (e1 >= dx1) {
-					e1 -= dx1;
-					//t1x += signx1;
-					if (changed1) t1xp = signx1;
-					else          goto next1;
-				}
-				if (changed1) break;
-				else t1x += signx1;
-			}
-			// Move line
-		next1:
-			// process second line until y value is about to change
-			while (1) {
-				e2 += dy2;
-				while (e2 >= dx2) {
-					e2 -= dx2;
-					//t2x += signx2;
-					if (changed2) t2xp = signx2;
-					else          goto next2;
-				}
-				if (changed2)     break;
-				else              t2x += signx2;
-			}
-		next2:
-			if (minx>t1x) minx = t1x;
-			if (minx>t2x) minx = t2x;
-			if (maxx<t1x) maxx = t1x;
-			if (maxx<t2x) maxx = t2x;
-			// Draw line from min to max points found on the y
-			drawline(minx, maxx, y);
-			// Now increase y
-			if (!changed1) t1x += signx1;
-			t1x += t1xp;
-			if (!changed2) t2x += signx2;
-			t2x += t2xp;
-			y += 1;
-			if (y == y2) break;
-
-		}
-	next:
-		// Second half
-		dx1 = (int)(x3 - x2); if (dx1<0) { dx1 = -dx1; signx1 = -1; }
-		else signx1 = 1;
-		dy1 = (int)(y3 - y2);
-		t1x = x2;
-
-		// swap values
-		if (dy1 > dx1) {
-			SWAP(dy1, dx1);
-			changed1 = true;
-		}
-		else changed1 = false;
-
-		e1 = (int)(dx1 >> 1);
-
-		for (int i = 0; i <= dx1; i++) {
-			t1xp = 0; t2xp = 0;
-			if (t1x<t2x) { minx = t1x; maxx = t2x; }
-			else { minx = t2x; maxx = t1x; }
-
-			// process first line until y value is about to change
-			while (i<dx1) {
-				e1 += dy1;
-				while (e1 >= dx1) {
-					e1 -= dx1;
-					//t1x += signx1;
-					if (changed1) { t1xp = signx1; break; }
-					else          goto next3;
+		if (n == 0) return;
+
+		if (!vUploadBuffers.empty())
+		{
+			// Cycle through the buffers, and orphan the storage so the driver
+			// hands back fresh memory rather than waiting for a pending transfer
+			jpr_glBindBuffer(GL_PIXEL_UNPACK_BUFFER, vUploadBuffers[nUploadBuffer]);
+			nUploadBuffer = (nUploadBuffer + 1) % vUploadBuffers.size();
+			jpr_glBufferData(GL_PIXEL_UNPACK_BUFFER, (ptrdiff_t)nScreenWidth * nScreenHeight * sizeof(Pixel), nullptr, GL_STREAM_DRAW);
+
+			Pixel* pBuffer = (Pixel*)jpr_glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+			if (pBuffer)
+			{
+				// Pack each rectangle tightly, one after the other
+				size_t nOffset[nMaxDirtyRects];
+				size_t o = 0;
+				for (int i = 0; i < n; i++)
+				{
+					const sDirtyRect& r = rects[i];
+					nOffset[i] = o;
+					for (int32_t y = r.y0; y < r.y1; y++, o += r.x1 - r.x0)
+						std::copy(pScreen + y * nScreenPitch + r.x0, pScreen + y * nScreenPitch + r.x1, pBuffer + o);
 				}
-				if (changed1) break;
-				else   	   	  t1x += signx1;
-				if (i<dx1) i++;
-			}
-		next3:
-			// process second line until y value is about to change
-			while (t2x != x3) {
-				e2 += dy2;
-				while (e2 >= dx2) {
-					e2 -= dx2;
-					if (changed2) t2xp = signx2;
-					else          goto next4;
+				jpr_glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+				// With a buffer bound, the data pointer is an offset into it and
+				// these calls return without waiting for the copy to happen
+				for (int i = 0; i < n; i++)
+				{
+					const sDirtyRect& r = rects[i];
+					glTexSubImage2D(GL_TEXTURE_2D, 0, r.x0, r.y0, r.x1 - r.x0, r.y1 - r.y0, GL_RGBA, GL_UNSIGNED_BYTE,
+						(void*)(nOffset[i] * sizeof(Pixel)));
 				}
-				if (changed2)     break;
-				else              t2x += signx2;
+				jpr_glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+				return;
 			}
-		next4:
+			jpr_glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		}
 
-			if (minx>t1x) minx = t1x;
-			if (minx>t2x) minx = t2x;
-			if (maxx<t1x) maxx = t1x;
-			if (maxx<t2x) maxx = t2x;
-			drawline(minx, maxx, y);
-			if (!changed1) t1x += signx1;
-			t1x += t1xp;
-			if (!changed2) t2x += signx2;
-			t2x += t2xp;
-			y += 1;
-			if (y>y3) return;
+		// Synchronous upload, sub-rectangles are read straight out of the padded screen rows
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, nScreenPitch);
+		for (int i = 0; i < n; i++)
+		{
+			const sDirtyRect& r = rects[i];
+			glTexSubImage2D(GL_TEXTURE_2D, 0, r.x0, r.y0, r.x1 - r.x0, r.y1 - r.y0, GL_RGBA, GL_UNSIGNED_BYTE,
+				pScreen + r.y0 * nScreenPitch + r.x0);
 		}
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
 	}
 
-	void RetroGameEngine::DrawSprite(int32_t x, int32_t y, Sprite *sprite, uint32_t scale)
+	void RetroGameEngine::SetPixelMode(Pixel::Mode m)
 	{
-		if (sprite == nullptr)
-			return;
+		nPixelMode = m;
+	}
 
-		if (scale > 1)
-		{
-			for (int32_t i = 0; i < sprite->width; i++)
-				for (int32_t j = 0; j < sprite->height; j++)
-					for (uint32_t is = 0; is < scale; is++)
-						for (uint32_t js = 0; js < scale; js++)
-							Draw(x + (i*scale) + is, y + (j*scale) + js, sprite->GetPixel(i, j));
-		}
-		else
-		{
-			for (int32_t i = 0; i < sprite->width; i++)
-				for (int32_t j = 0; j < sprite->height; j++)
-					Draw(x + i, y + j, sprite->GetPixel(i, j));
-		}
+	Pixel::Mode RetroGameEngine::GetPixelMode()
+	{
+		return nPixelMode;
 	}
 
-	void RetroGameEngine::DrawPartialSprite(int32_t x, int32_t y, Sprite *sprite, int32_t ox, int32_t oy, int32_t w, int32_t h, uint32_t scale)
+	void RetroGameEngine::SetPixelMode(std::function<jpr::Pixel(const int x, const int y, const jpr::Pixel&, const jpr::Pixel&)> pixelMode)
 	{
-		if (sprite == nullptr)
-			return;
+		funcPixelMode = pixelMode;
+		nPixelMode = Pixel::Mode::CUSTOM;
+		nPixelFuncVersion++;
+	}
 
-		if (scale > 1)
-		{
-			for (int32_t i = 0; i < w; i++)
-				for (int32_t j = 0; j < h; j++)
-					for (uint32_t is = 0; is < scale; is++)
-						for (uint32_t js = 0; js < scale; js++)
-							Draw(x + (i*scale) + is, y + (j*scale) + js, sprite->GetPixel(i + ox, j + oy));
-		}
+	void RetroGameEngine::SetPixelBlend(float fBlend)
+	{
+		fBlendFactor = fBlend;
+		if (fBlendFactor < 0.0f) fBlendFactor = 0.0f;
+		if (fBlendFactor > 1.0f) fBlendFactor = 1.0f;
+	}
+
+	// User must override these functions as required. I have not made
+	// them abstract because I do need a default behaviour to occur if
+	// they are not overwritten
+
+	bool RetroGameEngine::OnUserCreate()
+	{ return false; }
+	bool RetroGameEngine::OnUserUpdate(float fElapsedTime)
+	{ UNUSED(fElapsedTime);  return false; }
+	bool RetroGameEngine::OnUserDestroy()
+	{ return true; }
+	bool RetroGameEngine::OnUserFixedUpdate(float fFixedElapsedTime)
+	{ UNUSED(fFixedElapsedTime); return true; }
+
+	void RetroGameEngine::SetFixedTimestep(float fHz)
+	{
+		fFixedTimestep = fHz > 0.0f ? 1.0f / fHz : 0.0f;
+		fFixedAccumulator = 0.0f;
+		fInterpolation = 0.0f;
+	}
+
+	float RetroGameEngine::GetInterpolation()
+	{
+		return fInterpolation;
+	}
+
+	void RetroGameEngine::SetFrameRateLimit(float fFPS)
+	{
+		if (fFPS > 0.0f)
+			tpFramePeriod = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / fFPS));
 		else
-		{
-			for (int32_t i = 0; i < w; i++)
-				for (int32_t j = 0; j < h; j++)
-					Draw(x + i, y + j, sprite->GetPixel(i + ox, j + oy));
-		}
+			tpFramePeriod = std::chrono::steady_clock::duration::zero();
+		tpNextFrame = std::chrono::steady_clock::now();
 	}
 
-	void RetroGameEngine::DrawString(int32_t x, int32_t y, std::string sText, Pixel col, uint32_t scale)
+	jpr::rcode RetroGameEngine::EnableFrameStats(uint32_t nHistory, std::string sCSVFile)
 	{
-		int32_t sx = 0;
-		int32_t sy = 0;
-		Pixel::Mode m = nPixelMode;
-		if(col.ALPHA != 255)	SetPixelMode(Pixel::ALPHA);
-		else					SetPixelMode(Pixel::MASK);
-		for (auto c : sText)
-		{
-			if (c == '\n')
-			{
-				sx = 0; sy += 8 * scale;
-			}
-			else
-			{
-				int32_t ox = (c - 32) % 16;
-				int32_t oy = (c - 32) / 16;
+		DisableFrameStats();
 
-				if (scale > 1)
-				{
-					for (uint32_t i = 0; i < 8; i++)
-						for (uint32_t j = 0; j < 8; j++)
-							if (fontSprite->GetPixel(i + ox * 8, j + oy * 8).r > 0)
-								for (uint32_t is = 0; is < scale; is++)
-									for (uint32_t js = 0; js < scale; js++)
-										Draw(x + sx + (i*scale) + is, y + sy + (j*scale) + js, col);
-				}
-				else
-				{
-					for (uint32_t i = 0; i < 8; i++)
-						for (uint32_t j = 0; j < 8; j++)
-							if (fontSprite->GetPixel(i + ox * 8, j + oy * 8).r > 0)
-								Draw(x + sx + i, y + sy + j, col);
-				}
-				sx += 8 * scale;
-			}
+		// Only start recording once the CSV, if any, is open
+		FrameStats* pStats = new FrameStats(nHistory);
+		if (!sCSVFile.empty() && pStats->OpenCSV(sCSVFile) != jpr::OK)
+		{
+			delete pStats;
+			return jpr::FAIL;
 		}
-		SetPixelMode(m);
+		pFrameStats = pStats;
+		return jpr::OK;
 	}
 
-	void RetroGameEngine::SetPixelMode(Pixel::Mode m)
+	void RetroGameEngine::DisableFrameStats()
 	{
-		nPixelMode = m;
+		delete pFrameStats;
+		pFrameStats = nullptr;
 	}
 
-	Pixel::Mode RetroGameEngine::GetPixelMode()
+	FrameStats* RetroGameEngine::GetFrameStats()
 	{
-		return nPixelMode;
+		return pFrameStats;
 	}
 
-	void RetroGameEngine::SetPixelMode(std::function<jpr::Pixel(const int x, const int y, const jpr::Pixel&, const jpr::Pixel&)> pixelMode)
+	void RetroGameEngine::jpr_BeginFrameStats()
 	{
-		funcPixelMode = pixelMode;
-		nPixelMode = Pixel::Mode::CUSTOM;
+		if (!pFrameStats) return;
+		std::fill(fPhaseTimes, fPhaseTimes + FrameStats::PHASE_COUNT, 0.0f);
+		tpFrameStart = tpPhaseStart = std::chrono::steady_clock::now();
 	}
 
-	void RetroGameEngine::SetPixelBlend(float fBlend)
+	void RetroGameEngine::jpr_LapFrameStats(FrameStats::Phase p)
 	{
-		fBlendFactor = fBlend;
-		if (fBlendFactor < 0.0f) fBlendFactor = 0.0f;
-		if (fBlendFactor > 1.0f) fBlendFactor = 1.0f;
+		if (!pFrameStats) return;
+		auto tpNow = std::chrono::steady_clock::now();
+		fPhaseTimes[p] += std::chrono::duration<float, std::milli>(tpNow - tpPhaseStart).count();
+		tpPhaseStart = tpNow;
 	}
 
-	// User must override these functions as required. I have not made
-	// them abstract because I do need a default behaviour to occur if
-	// they are not overwritten
+	void RetroGameEngine::jpr_EndFrameStats()
+	{
+		if (!pFrameStats) return;
+		fPhaseTimes[FrameStats::FRAME] = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - tpFrameStart).count();
+		pFrameStats->Record(fPhaseTimes);
+	}
 
-	bool RetroGameEngine::OnUserCreate()
-	{ return false; }
-	bool RetroGameEngine::OnUserUpdate(float fElapsedTime)
-	{ UNUSED(fElapsedTime);  return false; }
-	bool RetroGameEngine::OnUserDestroy()
-	{ return true; }
+	bool RetroGameEngine::jpr_UpdateFrame(float fElapsedTime)
+	{
+		jpr_UpdateInputState();
+		jpr_LapFrameStats(FrameStats::INPUT);
+
+#ifdef JPR_DBG_OVERDRAW
+		jpr::Sprite::nOverdrawCount = 0;
+		std::fill(nDbgPrimitivePixels, nDbgPrimitivePixels + DBG_PRIMITIVE_COUNT, 0);
+		pDefaultDrawTarget->ResetOverdraw();
+#endif
+
+		bool bContinue = true;
+		if (fFixedTimestep > 0.0f)
+		{
+			// Don't let a long stall turn into an ever growing backlog of steps
+			const int nMaxSteps = 8;
+			fFixedAccumulator = std::min(fFixedAccumulator + fElapsedTime, fFixedTimestep * nMaxSteps);
+			while (bContinue && fFixedAccumulator >= fFixedTimestep)
+			{
+				bContinue = OnUserFixedUpdate(fFixedTimestep);
+				fFixedAccumulator -= fFixedTimestep;
+			}
+			fInterpolation = fFixedAccumulator / fFixedTimestep;
+		}
+
+		// Handle Frame Update
+		if (bContinue && !OnUserUpdate(fElapsedTime))
+			bContinue = false;
+		EndDeferred();
+
+		jpr_LapFrameStats(FrameStats::UPDATE);
+		return bContinue;
+	}
+
+	void RetroGameEngine::jpr_LimitFrameRate()
+	{
+		using namespace std::chrono;
+		if (tpFramePeriod == steady_clock::duration::zero()) return;
+
+		// Deadlines advance by whole periods so the average rate is exact, but
+		// after falling a full frame behind there is no point catching up
+		auto tpNow = steady_clock::now();
+		tpNextFrame += tpFramePeriod;
+		if (tpNextFrame + tpFramePeriod < tpNow)
+			tpNextFrame = tpNow;
+
+		// Sleep is coarse, so stop short and spin out the remainder
+		const auto tpSpin = milliseconds(2);
+		while (tpNow < tpNextFrame)
+		{
+			if (tpNextFrame - tpNow > tpSpin)
+				std::this_thread::sleep_for(tpNextFrame - tpNow - tpSpin);
+			else
+				std::this_thread::yield();
+			tpNow = steady_clock::now();
+		}
+	}
 
 	void RetroGameEngine::jpr_UpdateViewport()
 	{
@@ -1632,6 +4634,65 @@ namespace jpr
 			nMousePosYcache = 0;
 	}
 
+	void RetroGameEngine::jpr_UpdateInputState()
+	{
+		std::lock_guard<std::mutex> lock(muxInput);
+
+		// Handle User Input - Keyboard
+		for (int i = 0; i < 256; i++)
+		{
+			pKeyboardState[i].bPressed = false;
+			pKeyboardState[i].bReleased = false;
+
+			if (pKeyNewState[i] != pKeyOldState[i])
+			{
+				if (pKeyNewState[i])
+				{
+					pKeyboardState[i].bPressed = !pKeyboardState[i].bHeld;
+					pKeyboardState[i].bHeld = true;
+				}
+				else
+				{
+					pKeyboardState[i].bReleased = true;
+					pKeyboardState[i].bHeld = false;
+				}
+			}
+
+			pKeyOldState[i] = pKeyNewState[i];
+		}
+
+		// Handle User Input - Mouse
+		for (int i = 0; i < 5; i++)
+		{
+			pMouseState[i].bPressed = false;
+			pMouseState[i].bReleased = false;
+
+			if (pMouseNewState[i] != pMouseOldState[i])
+			{
+				if (pMouseNewState[i])
+				{
+					pMouseState[i].bPressed = !pMouseState[i].bHeld;
+					pMouseState[i].bHeld = true;
+				}
+				else
+				{
+					pMouseState[i].bReleased = true;
+					pMouseState[i].bHeld = false;
+				}
+			}
+
+			pMouseOldState[i] = pMouseNewState[i];
+		}
+
+		// Cache mouse coordinates so they remain
+		// consistent during frame
+		nMousePosX = nMousePosXcache;
+		nMousePosY = nMousePosYcache;
+
+		nMouseWheelDelta = nMouseWheelDeltaCache;
+		nMouseWheelDeltaCache = 0;
+	}
+
 	void RetroGameEngine::EngineThread()
 	{
 		// Start OpenGL, the context is owned by the game thread
@@ -1645,15 +4706,33 @@ namespace jpr
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 		glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_DECAL);
 
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, nScreenPitch);
 		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, nScreenWidth, nScreenHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, pDefaultDrawTarget->GetData());
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+		// Optional asynchronous upload path
+		if (bAsyncUpload && !jpr_CreateUploadBuffers())
+		{
+			printf("NOTE: Pixel buffer objects are not supported by this OpenGL driver,\n");
+			printf("      frames will be uploaded synchronously instead.\n");
+		}
 
+		// Threaded mode, this thread only presents while GameThread() simulates
+		if (bThreadedPresent)
+		{
+			jpr_PresentThread();
+			jpr_DestroyUploadBuffers();
+			jpr_DestroyContextAndWindow();
+			return;
+		}
 
 		// Create user resources as part of this thread
 		if (!OnUserCreate())
 			bAtomActive = false;
 
-		auto tp1 = std::chrono::system_clock::now();
-		auto tp2 = std::chrono::system_clock::now();
+		auto tp1 = std::chrono::steady_clock::now();
+		auto tp2 = std::chrono::steady_clock::now();
+		tpNextFrame = tp1;
 
 		while (bAtomActive)
 		{
@@ -1661,228 +4740,332 @@ namespace jpr
 			while (bAtomActive)
 			{
 				// Handle Timing
-				tp2 = std::chrono::system_clock::now();
+				tp2 = std::chrono::steady_clock::now();
 				std::chrono::duration<float> elapsedTime = tp2 - tp1;
 				tp1 = tp2;
 
 				// Our time per frame coefficient
 				float fElapsedTime = elapsedTime.count();
 
-#if defined(__linux__)
+				jpr_BeginFrameStats();
+				jpr_HandleSystemEvents();
+				jpr_LapFrameStats(FrameStats::EVENTS);
 
-				// Handle Xlib Message Loop - we do this in the
-				// same thread that OpenGL was created so we dont
-				// need to worry too much about multithreading with X11
+				if (!jpr_UpdateFrame(fElapsedTime))
+					bAtomActive = false;
 
-				XEvent xev;
-				while (XPending(jpr_Display))
-				{
-					XNextEvent(jpr_Display, &xev);
-					if (xev.type == Expose)
-					{
-						XWindowAttributes gwa;
-						XGetWindowAttributes(jpr_Display, jpr_Window, &gwa);
-						nWindowWidth = gwa.width;
-						nWindowHeight = gwa.height;
-						jpr_UpdateViewport();
-						glClear(GL_COLOR_BUFFER_BIT);
-					}
-					else if (xev.type == ConfigureNotify)
-					{
-						XConfigureEvent xce = xev.xconfigure;
-						nWindowWidth = xce.width;
-						nWindowHeight = xce.height;
-					}
-					else if (xev.type == KeyPress)
-					{
-						KeySym sym = XLookupKeysym(&xev.xkey, 0);
-						pKeyNewState[mapKeys[sym]] = true;
-						XKeyEvent *e = (XKeyEvent *)&xev;
-						XLookupString(e, NULL, 0, &sym, NULL);
-						pKeyNewState[mapKeys[sym]] = true;
-					}
-					else if (xev.type == KeyRelease)
-					{
-						KeySym sym = XLookupKeysym(&xev.xkey, 0);
-						pKeyNewState[mapKeys[sym]] = false;
-						XKeyEvent *e = (XKeyEvent *)&xev;
-						XLookupString(e, NULL, 0, &sym, NULL);
-						pKeyNewState[mapKeys[sym]] = false;
-					}
-					else if (xev.type == ButtonPress)
-					{
-						switch (xev.xbutton.button)
-						{
-						case 1:	pMouseNewState[0] = true; break;
-						case 2:	pMouseNewState[2] = true; break;
-						case 3:	pMouseNewState[1] = true; break;
-						case 4:	jpr_UpdateMouseWheel(120); break;
-						case 5:	jpr_UpdateMouseWheel(-120); break;
-						default: break;
-						}
-					}
-					else if (xev.type == ButtonRelease)
-					{
-						switch (xev.xbutton.button)
-						{
-						case 1:	pMouseNewState[0] = false; break;
-						case 2:	pMouseNewState[2] = false; break;
-						case 3:	pMouseNewState[1] = false; break;
-						default: break;
-						}
-					}
-					else if (xev.type == MotionNotify)
-					{
-						jpr_UpdateMouse(xev.xmotion.x, xev.xmotion.y);
-					}
-					else if (xev.type == FocusIn)
-					{
-						bHasInputFocus = true;
-					}
-					else if (xev.type == FocusOut)
-					{
-						bHasInputFocus = false;
-					}
-					else if (xev.type == ClientMessage)
-					{
-						bAtomActive = false;
-					}
-				}
-#endif
+				// Display Graphics
+				jpr_PresentFrame(pDefaultDrawTarget->GetData(), !bDirtyTracking);
+				jpr_EndFrameStats();
+				jpr_LimitFrameRate();
 
-				// Handle User Input - Keyboard
-				for (int i = 0; i < 256; i++)
+				// Update Title Bar
+				fFrameTimer += fElapsedTime;
+				nFrameCount++;
+				if (fFrameTimer >= 1.0f)
 				{
-					pKeyboardState[i].bPressed = false;
-					pKeyboardState[i].bReleased = false;
-
-					if (pKeyNewState[i] != pKeyOldState[i])
-					{
-						if (pKeyNewState[i])
-						{
-							pKeyboardState[i].bPressed = !pKeyboardState[i].bHeld;
-							pKeyboardState[i].bHeld = true;
-						}
-						else
-						{
-							pKeyboardState[i].bReleased = true;
-							pKeyboardState[i].bHeld = false;
-						}
-					}
+					fFrameTimer -= 1.0f;
 
-					pKeyOldState[i] = pKeyNewState[i];
+					jpr_UpdateTitle(nFrameCount);
+					nFrameCount = 0;
 				}
+			}
 
-				// Handle User Input - Mouse
-				for (int i = 0; i < 5; i++)
-				{
-					pMouseState[i].bPressed = false;
-					pMouseState[i].bReleased = false;
+			// Allow the user to free resources if they have overrided the destroy function
+			if (OnUserDestroy())
+			{
+				// User has permitted destroy, so exit and clean up
+			}
+			else
+			{
+				// User denied destroy for some reason, so continue running
+				bAtomActive = true;
+			}
+		}
 
-					if (pMouseNewState[i] != pMouseOldState[i])
-					{
-						if (pMouseNewState[i])
-						{
-							pMouseState[i].bPressed = !pMouseState[i].bHeld;
-							pMouseState[i].bHeld = true;
-						}
-						else
-						{
-							pMouseState[i].bReleased = true;
-							pMouseState[i].bHeld = false;
-						}
-					}
+		jpr_DestroyUploadBuffers();
+		jpr_DestroyContextAndWindow();
+	}
 
-					pMouseOldState[i] = pMouseNewState[i];
-				}
+	void RetroGameEngine::jpr_DestroyContextAndWindow()
+	{
+#if defined(_WIN32)
+		wglDeleteContext(glRenderContext);
+		PostMessage(jpr_hWnd, WM_DESTROY, 0, 0);
+#endif
 
-				// Cache mouse coordinates so they remain
-				// consistent during frame
-				nMousePosX = nMousePosXcache;
-				nMousePosY = nMousePosYcache;
+#if defined (__linux__)
+		glXMakeCurrent(jpr_Display, None, NULL);
+		glXDestroyContext(jpr_Display, glDeviceContext);
+		XDestroyWindow(jpr_Display, jpr_Window);
+		XCloseDisplay(jpr_Display);
+#endif
+	}
 
-				nMouseWheelDelta = nMouseWheelDeltaCache;
-				nMouseWheelDeltaCache = 0;
+	void RetroGameEngine::jpr_HandleSystemEvents()
+	{
+#if defined(__linux__)
+		// Handle Xlib Message Loop - we do this in the
+		// same thread that OpenGL was created so we dont
+		// need to worry too much about multithreading with X11
 
-#ifdef JPR_DBG_OVERDRAW
-				jpr::Sprite::nOverdrawCount = 0;
+		XEvent xev;
+		while (XPending(jpr_Display))
+		{
+			XNextEvent(jpr_Display, &xev);
+
+			// With a threaded present the game thread reads the input state concurrently
+			std::lock_guard<std::mutex> lock(muxInput);
+			if (xev.type == Expose)
+			{
+				XWindowAttributes gwa;
+				XGetWindowAttributes(jpr_Display, jpr_Window, &gwa);
+				nWindowWidth = gwa.width;
+				nWindowHeight = gwa.height;
+				jpr_UpdateViewport();
+				glClear(GL_COLOR_BUFFER_BIT);
+			}
+			else if (xev.type == ConfigureNotify)
+			{
+				XConfigureEvent xce = xev.xconfigure;
+				nWindowWidth = xce.width;
+				nWindowHeight = xce.height;
+			}
+			else if (xev.type == KeyPress)
+			{
+				KeySym sym = XLookupKeysym(&xev.xkey, 0);
+				pKeyNewState[mapKeys[sym]] = true;
+				XKeyEvent *e = (XKeyEvent *)&xev;
+				XLookupString(e, NULL, 0, &sym, NULL);
+				pKeyNewState[mapKeys[sym]] = true;
+			}
+			else if (xev.type == KeyRelease)
+			{
+				KeySym sym = XLookupKeysym(&xev.xkey, 0);
+				pKeyNewState[mapKeys[sym]] = false;
+				XKeyEvent *e = (XKeyEvent *)&xev;
+				XLookupString(e, NULL, 0, &sym, NULL);
+				pKeyNewState[mapKeys[sym]] = false;
+			}
+			else if (xev.type == ButtonPress)
+			{
+				switch (xev.xbutton.button)
+				{
+				case 1:	pMouseNewState[0] = true; break;
+				case 2:	pMouseNewState[2] = true; break;
+				case 3:	pMouseNewState[1] = true; break;
+				case 4:	jpr_UpdateMouseWheel(120); break;
+				case 5:	jpr_UpdateMouseWheel(-120); break;
+				default: break;
+				}
+			}
+			else if (xev.type == ButtonRelease)
+			{
+				switch (xev.xbutton.button)
+				{
+				case 1:	pMouseNewState[0] = false; break;
+				case 2:	pMouseNewState[2] = false; break;
+				case 3:	pMouseNewState[1] = false; break;
+				default: break;
+				}
+			}
+			else if (xev.type == MotionNotify)
+			{
+				jpr_UpdateMouse(xev.xmotion.x, xev.xmotion.y);
+			}
+			else if (xev.type == FocusIn)
+			{
+				bHasInputFocus = true;
+			}
+			else if (xev.type == FocusOut)
+			{
+				bHasInputFocus = false;
+			}
+			else if (xev.type == ClientMessage)
+			{
+				bAtomActive = false;
+			}
+		}
 #endif
+	}
 
-				// Handle Frame Update
-				if (!OnUserUpdate(fElapsedTime))
-					bAtomActive = false;
+	void RetroGameEngine::jpr_PresentFrame(const Pixel* pFrame, bool bFullFrame)
+	{
+		glViewport(nViewX, nViewY, nViewW, nViewH);
 
-				// Display Graphics
-				glViewport(nViewX, nViewY, nViewW, nViewH);
+		// Copy pixel array into texture, or just the parts that changed
+		if (bFullFrame)
+		{
+			sDirtyRect rScreen = { 0, 0, (int32_t)nScreenWidth, (int32_t)nScreenHeight };
+			jpr_UploadRects(pFrame, &rScreen, 1);
+		}
+		else
+		{
+			jpr_UploadRects(pFrame, vDirtyRects, nDirtyRects);
+			nDirtyRects = 0;
+		}
 
-				// TODO: This is a bit slow (especially in debug, but 100x faster in release mode)
-				// Copy pixel array into texture
-				glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, nScreenWidth, nScreenHeight, GL_RGBA, GL_UNSIGNED_BYTE, pDefaultDrawTarget->GetData());
+		// The present thread has no frame of its own to time
+		if (!bThreadedPresent) jpr_LapFrameStats(FrameStats::UPLOAD);
 
-				// Display texture on screen
-				glBegin(GL_QUADS);
-					glTexCoord2f(0.0, 1.0); glVertex3f(-1.0f + (fSubPixelOffsetX), -1.0f + (fSubPixelOffsetY), 0.0f);
-					glTexCoord2f(0.0, 0.0); glVertex3f(-1.0f + (fSubPixelOffsetX),  1.0f + (fSubPixelOffsetY), 0.0f);
-					glTexCoord2f(1.0, 0.0); glVertex3f( 1.0f + (fSubPixelOffsetX),  1.0f + (fSubPixelOffsetY), 0.0f);
-					glTexCoord2f(1.0, 1.0); glVertex3f( 1.0f + (fSubPixelOffsetX), -1.0f + (fSubPixelOffsetY), 0.0f);
-				glEnd();
+		// Display texture on screen
+		glBegin(GL_QUADS);
+			glTexCoord2f(0.0, 1.0); glVertex3f(-1.0f + (fSubPixelOffsetX), -1.0f + (fSubPixelOffsetY), 0.0f);
+			glTexCoord2f(0.0, 0.0); glVertex3f(-1.0f + (fSubPixelOffsetX),  1.0f + (fSubPixelOffsetY), 0.0f);
+			glTexCoord2f(1.0, 0.0); glVertex3f( 1.0f + (fSubPixelOffsetX),  1.0f + (fSubPixelOffsetY), 0.0f);
+			glTexCoord2f(1.0, 1.0); glVertex3f( 1.0f + (fSubPixelOffsetX), -1.0f + (fSubPixelOffsetY), 0.0f);
+		glEnd();
 
-				// Present Graphics to screen
+		// Present Graphics to screen
 #if defined(_WIN32)
-				SwapBuffers(glDeviceContext);
+		SwapBuffers(glDeviceContext);
 #endif
 
 #if defined(__linux__)
-				glXSwapBuffers(jpr_Display, jpr_Window);
+		glXSwapBuffers(jpr_Display, jpr_Window);
 #endif
 
-				// Update Title Bar
-				fFrameTimer += fElapsedTime;
-				nFrameCount++;
-				if (fFrameTimer >= 1.0f)
-				{
-					fFrameTimer -= 1.0f;
+		if (!bThreadedPresent) jpr_LapFrameStats(FrameStats::PRESENT);
+	}
 
-					std::string sTitle = "OneLoneCoder.com - Pixel Game Engine - " + sAppName + " - FPS: " + std::to_string(nFrameCount);
+	void RetroGameEngine::jpr_UpdateTitle(int nFPS)
+	{
+			std::string sTitle = "OneLoneCoder.com - Pixel Game Engine - " + sAppName + " - FPS: " + std::to_string(nFPS);
 #if defined(_WIN32)
 #ifdef UNICODE
-					SetWindowText(jpr_hWnd, ConvertS2W(sTitle).c_str());
+			SetWindowText(jpr_hWnd, ConvertS2W(sTitle).c_str());
 #else
-					SetWindowText(jpr_hWnd, sTitle.c_str());
+			SetWindowText(jpr_hWnd, sTitle.c_str());
 #endif
 #endif
 
 #if defined (__linux__)
-					XStoreName(jpr_Display, jpr_Window, sTitle.c_str());
+			XStoreName(jpr_Display, jpr_Window, sTitle.c_str());
 #endif
-					nFrameCount = 0;
-				}
-			}
+	}
 
-			// Allow the user to free resources if they have overrided the destroy function
-			if (OnUserDestroy())
+	void RetroGameEngine::jpr_PresentThread()
+	{
+		// The game thread draws into its own buffer while this thread owns the
+		// OpenGL context, pumps window events and displays the newest frame
+		bGameRunning = true;
+		std::thread tGame = std::thread(&RetroGameEngine::GameThread, this);
+
+		while (bGameRunning)
+		{
+			jpr_HandleSystemEvents();
+
+			if (nReadyBuffer.load() & nFrameFresh)
 			{
-				// User has permitted destroy, so exit and clean up
+				// Swap the newest completed frame for the one just displayed
+				nPresentBuffer = nReadyBuffer.exchange(nPresentBuffer) & nBufferIndex;
+				jpr_PresentFrame(pFrameBuffers[nPresentBuffer]->GetData(), true);
 			}
 			else
 			{
-				// User denied destroy for some reason, so continue running
-				bAtomActive = true;
+				// Nothing new, sleep until a frame arrives but keep pumping events
+				std::unique_lock<std::mutex> lock(muxFrameReady);
+				cvFrameReady.wait_for(lock, std::chrono::milliseconds(1));
 			}
+
+			int nFPS = nGameFPS.exchange(-1);
+			if (nFPS >= 0) jpr_UpdateTitle(nFPS);
 		}
 
-#if defined(_WIN32)
-		wglDeleteContext(glRenderContext);
-		PostMessage(jpr_hWnd, WM_DESTROY, 0, 0);
-#endif
+		tGame.join();
+	}
 
-#if defined (__linux__)
-		glXMakeCurrent(jpr_Display, None, NULL);
-		glXDestroyContext(jpr_Display, glDeviceContext);
-		XDestroyWindow(jpr_Display, jpr_Window);
-		XCloseDisplay(jpr_Display);
-#endif
+	void RetroGameEngine::GameThread()
+	{
+		// Create user resources as part of this thread
+		if (!OnUserCreate())
+			bAtomActive = false;
+
+		auto tp1 = std::chrono::steady_clock::now();
+		auto tp2 = std::chrono::steady_clock::now();
+		tpNextFrame = tp1;
+		float fFPSTimer = 0.0f;
+		int nFPSCount = 0;
+
+		while (bAtomActive)
+		{
+			while (bAtomActive)
+			{
+				tp2 = std::chrono::steady_clock::now();
+				std::chrono::duration<float> elapsedTime = tp2 - tp1;
+				tp1 = tp2;
+				float fElapsedTime = elapsedTime.count();
+
+				jpr_BeginFrameStats();
+				if (!jpr_UpdateFrame(fElapsedTime))
+					bAtomActive = false;
+
+				// Publish the finished frame and take back whichever buffer is spare
+				int nCompleted = nDrawBuffer;
+				nDrawBuffer = nReadyBuffer.exchange(nDrawBuffer | nFrameFresh) & nBufferIndex;
+				cvFrameReady.notify_one();
+
+				// Carry the last frame over so drawing continues from it, just
+				// as it does with a single screen sprite
+				Sprite* pNext = pFrameBuffers[nDrawBuffer];
+				const Pixel* pLast = pFrameBuffers[nCompleted]->GetData();
+				std::copy(pLast, pLast + nScreenPitch * nScreenHeight, pNext->GetData());
+				if (pDrawTarget == pDefaultDrawTarget) pDrawTarget = pNext;
+				pDefaultDrawTarget = pNext;
+				jpr_LapFrameStats(FrameStats::PRESENT);
+				jpr_EndFrameStats();
+
+				fFPSTimer += fElapsedTime;
+				nFPSCount++;
+				if (fFPSTimer >= 1.0f)
+				{
+					fFPSTimer -= 1.0f;
+					nGameFPS = nFPSCount;
+					nFPSCount = 0;
+				}
+
+				jpr_LimitFrameRate();
+			}
+
+			// Allow the user to free resources if they have overrided the destroy function
+			if (!OnUserDestroy())
+				bAtomActive = true;
+		}
+
+		bGameRunning = false;
+		cvFrameReady.notify_one();
+	}
+
+
+	void RetroGameEngine::HeadlessThread(uint32_t nFrames, float fElapsedTime)
+	{
+		// Create user resources as part of this thread
+		if (!OnUserCreate())
+			bAtomActive = false;
+
+		auto tp1 = std::chrono::steady_clock::now();
+		auto tp2 = std::chrono::steady_clock::now();
+		uint32_t nFramesRun = 0;
 
+		// There are no events to pump and nothing to present, so frames
+		// run back to back and cost only what the user draws
+		while (bAtomActive && (nFrames == 0 || nFramesRun < nFrames))
+		{
+			tp2 = std::chrono::steady_clock::now();
+			std::chrono::duration<float> elapsedTime = tp2 - tp1;
+			tp1 = tp2;
+
+			jpr_BeginFrameStats();
+			if (!jpr_UpdateFrame(fElapsedTime > 0.0f ? fElapsedTime : elapsedTime.count()))
+				bAtomActive = false;
+			jpr_EndFrameStats();
+
+			nFramesRun++;
+		}
+
+		// Nobody is around to deny the destroy request, so always finish
+		OnUserDestroy();
+		bAtomActive = false;
 	}
 
 #if defined (_WIN32)
@@ -1922,7 +5105,7 @@ namespace jpr
 		data += "O`000P08Od400g`<3V=P0G`673IP0`@3>1`00P@6O`P00g`<O`000GP800000000";
 		data += "?P9PL020O`<`N3R0@E4HC7b0@ET<ATB0@@l6C4B0O`H3N7b0?P01L3R000000020";
 
-		fontSprite = new jpr::Sprite(128, 48);
+		fontSprite = new jpr::Sprite(128, 48, SpriteAllocator::Heap());
 		int px = 0, py = 0;
 		for (int b = 0; b < 1024; b += 4)
 		{
@@ -1939,6 +5122,17 @@ namespace jpr
 				if (++py == 48) { px++; py = 0; }
 			}
 		}
+
+		// Decode the sheet once more into per glyph row bitmasks for DrawString()
+		for (int g = 0; g < 96; g++)
+			for (int j = 0; j < 8; j++)
+			{
+				uint8_t bits = 0;
+				for (int i = 0; i < 8; i++)
+					if (fontSprite->GetPixel((g % 16) * 8 + i, (g / 16) * 8 + j).r > 0)
+						bits |= (uint8_t)(1 << i);
+				nFontGlyphs[g][j] = bits;
+			}
 	}
 
 #if defined(_WIN32)
@@ -2229,6 +5423,7 @@ namespace jpr
 	std::atomic<bool> RetroGameEngine::bAtomActive{ false };
 	std::map<size_t, uint8_t> RetroGameEngine::mapKeys;
 	jpr::RetroGameEngine* jpr::PGEX::pge = nullptr;
+	jpr::SpriteAllocator* jpr::Sprite::pDefaultAllocator = nullptr;
 #ifdef JPR_DBG_OVERDRAW
 	int jpr::Sprite::nOverdrawCount = 0;
 #endif